@@ -1,6 +1,7 @@
 #include "ast.h"
 #include "common.h"
 #include "aval.h"
+#include "bytecode.h"
 
 #include <cstdio>
 #include <cstring>
@@ -264,6 +265,11 @@ FunctionCall::FunctionCall(Expression* function, Expression *args, Expression *o
         arguments = new ExpressionList(args);
     }
     n3 = object;
+    if (object) {
+        objectArguments.push_back(object);
+        const std::vector<Expression*> &exprs = this->arguments()->expressions();
+        objectArguments.insert(objectArguments.end(), exprs.begin(), exprs.end());
+    }
 }
 
 FunctionCall::~FunctionCall()
@@ -293,6 +299,11 @@ ExpressionList* FunctionCall::arguments() const
     return (ExpressionList*)n2;
 }
 
+const std::vector<Expression*>& FunctionCall::callArguments() const
+{
+    return object() ? objectArguments : arguments()->expressions();
+}
+
 
 ExpressionList::ExpressionList()
 {
@@ -635,6 +646,7 @@ Function::Function(const std::string &name, VariableList *params, StatementList
 
 Function::~Function()
 {
+    delete chunk;
     del(parameters());
     del(statements());
 }
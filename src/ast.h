@@ -2,6 +2,7 @@
 
 #include <vector>
 #include <string>
+#include <unordered_map>
 
 namespace Ast
 {
@@ -43,6 +44,11 @@ class Function;
 
 }
 
+namespace Bytecode
+{
+struct Chunk;
+}
+
 #include "aval.h"
 
 namespace Ast
@@ -51,6 +57,13 @@ namespace Ast
 void cleanup();
 void del(Node *n);
 
+// Operand types an operator node specialized itself for on its first
+// evaluation. Each variant guards its types, when the guard fails the node
+// falls back to Generic for good.
+enum class Specialization : unsigned char {
+    None, Int, Double, String, Generic
+};
+
 class Node
 {
 public:
@@ -94,6 +107,11 @@ public:
     bool isconst;
 
     std::string name;
+
+    // Index into the frame of the enclosing function, -1 for lookup by name
+    int slot = -1;
+    // Cached global variable for variables evaluated in global scope
+    AVal *global = nullptr;
 };
 
 class ArraySubscript : public Expression
@@ -106,6 +124,9 @@ public:
 
     Expression *source() const;
     Expression *expression() const;
+
+    // Int indexes an array, String looks up a map
+    Specialization specialization = Specialization::None;
 };
 
 class AValLiteral : public Expression
@@ -191,6 +212,8 @@ public:
 
     Op op;
     Expression *expr() const;
+
+    Specialization specialization = Specialization::None;
 };
 
 class BinaryOperator : public Expression
@@ -211,6 +234,8 @@ public:
     Op op;
     Expression* left() const;
     Expression* right() const;
+
+    Specialization specialization = Specialization::None;
 };
 
 class FunctionCall : public Expression
@@ -224,6 +249,20 @@ public:
     Expression* object() const;
     Expression* function() const;
     ExpressionList* arguments() const;
+    // Arguments the function is called with, the object comes first
+    const std::vector<Expression*>& callArguments() const;
+
+    // Global binding the called name resolved to, valid while
+    // cacheVersion equals the version of call caches in Evaluator
+    AVal *cachedBinding = nullptr;
+    unsigned long cacheVersion = 0;
+    // Whether a return of this call may replace the frame of the function
+    // containing it when tailCallee is called
+    Function *tailCallee = nullptr;
+    bool replacesFrame = false;
+
+private:
+    std::vector<Expression*> objectArguments;
 };
 
 class ExpressionList : public Expression
@@ -371,6 +410,9 @@ public:
     bool isLambda() const;
 
     bool preprocessed = true;
+    bool resolved = false;
+    std::unordered_map<std::string, int> localSlots;
+    Bytecode::Chunk *chunk = nullptr;
 
     std::string name;
     VariableList *parameters() const;
@@ -2,6 +2,7 @@
 #include "common.h"
 #include "memorypool.h"
 
+#include <algorithm>
 #include <cmath>
 #include <cstring>
 #include <cstdlib>
@@ -11,8 +12,111 @@
 AArray emptyArray;
 
 
-std::unordered_set<AVal*> localAVals;
+std::vector<AVal*> localAVals;
 
+size_t AVal::copies = 0;
+size_t AVal::trackedCopies = 0;
+
+static const uint64_t PackedCanonicalNaN = 0x7FF8000000000000ULL;
+
+// Indexed by PackedAVal::Tag
+static const AVal::Type packedTypes[] = {
+    AVal::UNDEFINED,
+    AVal::INT,
+    AVal::BOOL,
+    AVal::CHAR,
+    AVal::STRING,
+    AVal::ARRAY,
+    AVal::FUNCTION,
+    AVal::FUNCTION_BUILTIN
+};
+
+
+static inline void addRoot(AVal *v)
+{
+    X_ASSERT(localAVals.size() + 1 < AVal::Framed);
+    v->_root = localAVals.size() + 1;
+    localAVals.push_back(v);
+}
+
+static inline void removeRoot(AVal *v)
+{
+    const unsigned int pos = v->_root - 1;
+    AVal *last = localAVals.back();
+    localAVals[pos] = last;
+    last->_root = pos + 1;
+    localAVals.pop_back();
+    v->_root = AVal::Unrooted;
+}
+
+static inline void updateRoot(AVal *v)
+{
+    if (v->_root == AVal::Framed) {
+        return;
+    }
+    const bool tracked = v->isTracked();
+    if (tracked && v->_root == AVal::Unrooted) {
+        addRoot(v);
+    } else if (!tracked && v->_root != AVal::Unrooted) {
+        removeRoot(v);
+    }
+}
+
+// Copies the value with dst keeping the root, all header fields are
+// read first and written together, so they take a single store
+static inline void copyValue(AVal *dst, const AVal &src, unsigned int root)
+{
+    const bool isConst = src._const;
+    const bool thrown = src._thrown;
+    const AVal::RefKind refKind = src._refKind;
+    const AVal::Type type = src._type;
+    const uint32_t index = src._index;
+    AArray *value = src.arrayValue;
+    dst->_const = isConst;
+    dst->_thrown = thrown;
+    dst->_refKind = refKind;
+    dst->_type = type;
+    dst->_root = root;
+    dst->_index = index;
+    // Pointers are the largest members of the union
+    dst->arrayValue = value;
+}
+
+static inline void countCopy(const AVal &src)
+{
+    AVal::copies++;
+    if (src.isTracked()) {
+        AVal::trackedCopies++;
+    }
+}
+
+// Moved value hands over its root stack entry and becomes undefined
+static inline void moveRoot(AVal *dst, AVal *src)
+{
+    if (dst->_root == AVal::Framed || src->_root == AVal::Framed) {
+        // The framed side stays in the frame stack, the other one is a copy
+        if (src->_root != AVal::Framed && src->_root != AVal::Unrooted) {
+            removeRoot(src);
+            src->_type = AVal::UNDEFINED;
+        }
+        updateRoot(dst);
+        return;
+    }
+    if (src->_root == AVal::Unrooted) {
+        if (dst->_root != AVal::Unrooted) {
+            removeRoot(dst);
+        }
+        return;
+    }
+    if (dst->_root != AVal::Unrooted) {
+        removeRoot(src);
+    } else {
+        dst->_root = src->_root;
+        localAVals[dst->_root - 1] = dst;
+        src->_root = AVal::Unrooted;
+    }
+    src->_type = AVal::UNDEFINED;
+}
 
 static AString *rstrdup(const char *str)
 {
@@ -24,19 +128,67 @@ static AString *rstrdup(const char *str)
     return out;
 }
 
+AVal::AVal(Type type)
+    : _const(false)
+    , _thrown(false)
+    , _refKind(VALUE_REF)
+    , _type(type)
+    , _root(Unrooted)
+    , _index(0)
+{
+}
+
 AVal::AVal()
-    : _type(UNDEFINED)
+    : AVal(UNDEFINED)
 {
 }
 
 AVal::AVal(const AVal& v)
 {
-    if(&v == this)
-        return;
+    countCopy(v);
+    copyValue(this, v, Unrooted);
+    updateRoot(this);
+}
+
+AVal::AVal(AVal&& v) noexcept
+{
+    copyValue(this, v, Unrooted);
+    moveRoot(this, &v);
+}
 
-    memcpy(this,&v, sizeof(*this));
-    if( isTracked() ){
-        localAVals.insert(this);
+AVal::AVal(const PackedAVal& v)
+    : AVal(v.type())
+{
+    const uint64_t payload = v.bits & PackedAVal::PayloadMask;
+    switch (_type) {
+    case INT:
+        intValue = int(uint32_t(payload));
+        break;
+    case BOOL:
+        boolValue = payload != 0;
+        break;
+    case CHAR:
+        charValue = char(payload);
+        break;
+    case DOUBLE:
+        memcpy(&doubleValue, &v.bits, sizeof(doubleValue));
+        break;
+    case STRING:
+        stringValue = reinterpret_cast<AString*>(payload);
+        addRoot(this);
+        break;
+    case ARRAY:
+        arrayValue = reinterpret_cast<AArray*>(payload);
+        addRoot(this);
+        break;
+    case FUNCTION:
+        functionValue = reinterpret_cast<Ast::Function*>(payload);
+        break;
+    case FUNCTION_BUILTIN:
+        builtinFunctionValue = reinterpret_cast<BuiltinCall>(payload);
+        break;
+    default:
+        break;
     }
 }
 
@@ -45,77 +197,81 @@ AVal& AVal::operator=(const AVal& v)
     if(&v == this)
         return *this;
 
-    bool old_tracked = isTracked();
+    countCopy(v);
+    copyValue(this, v, _root);
+    updateRoot(this);
+    return *this;
+}
 
-    memcpy(this,&v, sizeof(*this));
+AVal& AVal::operator=(AVal&& v) noexcept
+{
+    if(&v == this)
+        return *this;
 
-    bool new_tracked = isTracked();
-    if( new_tracked != old_tracked ){
-        if( new_tracked ){
-            localAVals.insert(this);
-        }else{
-            localAVals.erase(this);
-        }
-    }
+    copyValue(this, v, _root);
+    moveRoot(this, &v);
     return *this;
 }
 
 AVal::AVal(AVal *value)
-    : _type(REFERENCE)
-    , referenceValue(value)
+    : AVal(REFERENCE)
 {
-    if( isTracked() ){
-        localAVals.insert(this);
-    }
+    referenceValue = value;
 }
 
 AVal::AVal(int value)
-    : _type(INT)
+    : AVal(INT)
 {
     intValue = value;
 }
 
 AVal::AVal(bool value)
-    : _type(BOOL)
+    : AVal(BOOL)
 {
     boolValue = value;
 }
 
 AVal::AVal(char value)
-    : _type(CHAR)
-    , charValue(value)
+    : AVal(CHAR)
 {
+    charValue = value;
 }
 
 AVal::AVal(double value)
-    : _type(DOUBLE)
-    , doubleValue(value)
+    : AVal(DOUBLE)
 {
+    doubleValue = value;
 }
 
 AVal::AVal(const char *value)
-    : _type(STRING)
-    , stringValue(nullptr)
+    : AVal(STRING)
 {
     stringValue = rstrdup(value);
-    localAVals.insert(this);
+    addRoot(this);
+}
+
+AVal::AVal(AString *value)
+    : AVal(STRING)
+{
+    stringValue = value;
+    addRoot(this);
 }
 
 AVal::AVal(AArray *value)
-    : _type(ARRAY)
+    : AVal(ARRAY)
 {
     arrayValue = value;
-    localAVals.insert(this);
+    addRoot(this);
 }
 
 AVal::AVal(Ast::Function *value)
-    : _type(FUNCTION)
+    : AVal(FUNCTION)
 {
     functionValue = value;
 }
 
 AVal::AVal(BuiltinCall value)
-    : _type(FUNCTION_BUILTIN)
+    : AVal(FUNCTION_BUILTIN)
 {
     builtinFunctionValue = value;
 }
@@ -123,8 +279,8 @@ AVal::AVal(BuiltinCall value)
 
 AVal::~AVal()
 {
-    if( isTracked() ){
-        localAVals.erase(this);
+    if (_root != Unrooted && _root != Framed) {
+        removeRoot(this);
     }
 }
 
@@ -147,6 +303,9 @@ const char *AVal::typeStr() const
         "function",
         "function" //FUNCTION_BUILTIN
     };
+    if (type() == ARRAY && arrayValue->keys) {
+        return "map";
+    }
     return tNames[(int)type()];
 }
 
@@ -154,16 +313,10 @@ AVal AVal::copy() const
 {
     switch (type()) {
     case STRING:
-        return toString();
+        return MemoryPool::copyString(stringValue);
 
-    case ARRAY: {
-        void *mem;
-        size_t size =AArray::allocSize(arrayValue->count);
-        AArray *a = (AArray*)MemoryPool::alloc(size, &mem);
-        memcpy(a, arrayValue, size);
-        a->mem = mem;
-        return a;
-    }
+    case ARRAY:
+        return MemoryPool::copyArray(arrayValue);
 
     default:
         return *this;
@@ -173,38 +326,101 @@ AVal AVal::copy() const
 AVal AVal::dereference() const
 {
     if (isReference()) {
-        return *toReference();
+        switch (_refKind) {
+        case CHAR_REF:
+            return charReferenceValue->chars()[_index];
+        case ELEMENT_REF:
+            return elementReferenceValue->get(_index);
+        default:
+            return *toReference();
+        }
     }
     return *this;
 }
 
+const AVal &AVal::deref() const
+{
+    if (_type == REFERENCE && _refKind == VALUE_REF) {
+        return *referenceValue;
+    }
+    return *this;
+}
+
+// Type of the value, for references type of the referenced value
+static inline AVal::Type targetType(const AVal &v)
+{
+    if (v._type != AVal::REFERENCE) {
+        return v._type;
+    }
+    switch (v._refKind) {
+    case AVal::CHAR_REF:
+        return AVal::CHAR;
+    case AVal::ELEMENT_REF: {
+        const AArray *a = v.elementReferenceValue;
+        switch (a->kind) {
+        case AArray::INT32:
+            return AVal::INT;
+        case AArray::DOUBLE:
+            return AVal::DOUBLE;
+        case AArray::CHAR:
+            return AVal::CHAR;
+        default:
+            return a->array[v._index].type();
+        }
+    }
+    default:
+        return v.referenceValue->_type;
+    }
+}
+
 void AVal::assign(const AVal &value)
 {
-    if (_charref) {
+    switch (_refKind) {
+    case CHAR_REF:
         if (value.isChar()) {
-            *reinterpret_cast<char*>(referenceValue) = value.toChar();
+            MemoryPool::makeWritable(charReferenceValue)[_index] = value.toChar();
         } else {
             fprintf(stderr, "Cannot assign '%s' to char\n", value.dereference().typeStr());
         }
-    } else {
+        break;
+    case ELEMENT_REF:
+        MemoryPool::makeWritable(elementReferenceValue);
+        elementReferenceValue->set(_index, value);
+        break;
+    default:
         *this = value;
+        break;
     }
 }
 
 // static
-AVal AVal::createCharReference(char *value)
+AVal AVal::createCharReference(AString *string, size_t index)
 {
-    AVal v(reinterpret_cast<AVal*>(value));
-    v._charref = true;
+    AVal v(static_cast<AVal*>(nullptr));
+    v._refKind = CHAR_REF;
+    X_ASSERT(index <= UINT32_MAX);
+    v.charReferenceValue = string;
+    v._index = index;
+    // The string stays alive as long as the reference does
+    updateRoot(&v);
+    return v;
+}
+
+// static
+AVal AVal::createElementReference(AArray *array, size_t index)
+{
+    AVal v(static_cast<AVal*>(nullptr));
+    v._refKind = ELEMENT_REF;
+    X_ASSERT(index <= UINT32_MAX);
+    v.elementReferenceValue = array;
+    v._index = index;
+    updateRoot(&v);
     return v;
 }
 
 bool AVal::isUndefined() const
 {
-    if (isReference()) {
-        return dereference()._type == UNDEFINED;
-    }
-    return _type == UNDEFINED;
+    return targetType(*this) == UNDEFINED;
 }
 
 bool AVal::isReference() const
@@ -214,66 +430,42 @@ bool AVal::isReference() const
 
 bool AVal::isInt() const
 {
-    if (isReference()) {
-        return dereference()._type == INT;
-    }
-    return _type == INT;
+    return targetType(*this) == INT;
 }
 
 bool AVal::isBool() const
 {
-    if (isReference()) {
-        return dereference()._type == BOOL;
-    }
-    return _type == BOOL;
+    return targetType(*this) == BOOL;
 }
 
 bool AVal::isChar() const
 {
-    if (isReference()) {
-        return dereference()._type == CHAR;
-    }
-    return _type == CHAR;
+    return targetType(*this) == CHAR;
 }
 
 bool AVal::isDouble() const
 {
-    if (isReference()) {
-        return dereference()._type == DOUBLE;
-    }
-    return _type == DOUBLE;
+    return targetType(*this) == DOUBLE;
 }
 
 bool AVal::isString() const
 {
-    if (isReference()) {
-        return dereference()._type == STRING;
-    }
-    return _type == STRING;
+    return targetType(*this) == STRING;
 }
 
 bool AVal::isArray() const
 {
-    if (isReference()) {
-        return dereference()._type == ARRAY;
-    }
-    return _type == ARRAY;
+    return targetType(*this) == ARRAY;
 }
 
 bool AVal::isFunction() const
 {
-    if (isReference()) {
-        return dereference()._type == FUNCTION;
-    }
-    return _type == FUNCTION;
+    return targetType(*this) == FUNCTION;
 }
 
 bool AVal::isBuiltinFunction() const
 {
-    if (isReference()) {
-        return dereference()._type == FUNCTION_BUILTIN;
-    }
-    return _type == FUNCTION_BUILTIN;
+    return targetType(*this) == FUNCTION_BUILTIN;
 }
 
 bool AVal::isConst() const
@@ -288,13 +480,9 @@ bool AVal::isThrown() const
 
 bool AVal::isTracked() const
 {
-    Type t;
-    if(isReference()) {
-        t = referenceValue->type();
-    }else{
-        t = type();
-    }
-    return t == STRING || t == ARRAY;
+    // Value references point to other AVals, element and char references keep
+    // their owner, which may be a temporary
+    return _type == STRING || _type == ARRAY || (_type == REFERENCE && _refKind != VALUE_REF);
 }
 
 void AVal::markConst(bool is)
@@ -309,46 +497,81 @@ void AVal::markThrown(bool is)
 
 AVal *AVal::toReference() const
 {
+    if (_type == REFERENCE) {
+        return referenceValue;
+    }
     return convertTo(REFERENCE).referenceValue;
 }
 
 int AVal::toInt() const
 {
+    const AVal &v = deref();
+    if (v._type == INT) {
+        return v.intValue;
+    }
     return convertTo(INT).intValue;
 }
 
 bool AVal::toBool() const
 {
+    const AVal &v = deref();
+    if (v._type == BOOL) {
+        return v.boolValue;
+    }
     return convertTo(BOOL).boolValue;
 }
 
 char AVal::toChar() const
 {
+    const AVal &v = deref();
+    if (v._type == CHAR) {
+        return v.charValue;
+    }
     return convertTo(CHAR).charValue;
 }
 
 double AVal::toDouble() const
 {
+    const AVal &v = deref();
+    if (v._type == DOUBLE) {
+        return v.doubleValue;
+    }
     return convertTo(DOUBLE).doubleValue;
 }
 
 Ast::Function *AVal::toFunction() const
 {
+    const AVal &v = deref();
+    if (v._type == FUNCTION) {
+        return v.functionValue;
+    }
     return convertTo(FUNCTION).functionValue;
 }
 
 const char *AVal::toString() const
 {
-    return convertTo(STRING).stringValue->string;
+    const AVal &v = deref();
+    if (v._type == STRING) {
+        return v.stringValue->chars();
+    }
+    return convertTo(STRING).stringValue->chars();
 }
 
 AArray *AVal::toArray() const
 {
+    const AVal &v = deref();
+    if (v._type == ARRAY) {
+        return v.arrayValue;
+    }
     return convertTo(ARRAY).arrayValue;
 }
 
 BuiltinCall AVal::toBuiltinFunction() const
 {
+    const AVal &v = deref();
+    if (v._type == FUNCTION_BUILTIN) {
+        return v.builtinFunctionValue;
+    }
     return convertTo(FUNCTION_BUILTIN).builtinFunctionValue;
 }
 
@@ -507,13 +730,13 @@ AVal AVal::convertTo(Type t) const
     case STRING:
         switch (t) {
         case INT:
-            return atoi(stringValue->string);
+            return atoi(stringValue->chars());
         case BOOL:
-            return strlen(stringValue->string) > 0;
+            return strlen(stringValue->chars()) > 0;
         case CHAR:
             return char(0);
         case DOUBLE:
-            return atof(stringValue->string);
+            return atof(stringValue->chars());
         case FUNCTION:
         case FUNCTION_BUILTIN:
             return static_cast<Ast::Function*>(nullptr);
@@ -533,7 +756,7 @@ AVal AVal::convertTo(Type t) const
         case FUNCTION_BUILTIN:
             return AVal(0).convertTo(t);
         case STRING:
-            return "[array]";
+            return arrayValue->keys ? "[map]" : "[array]";
         default:
             X_UNREACHABLE();
         }
@@ -544,3 +767,328 @@ AVal AVal::convertTo(Type t) const
 
     return 0;
 }
+
+
+static inline uint64_t box(PackedAVal::Tag tag, uint64_t payload)
+{
+    return PackedAVal::Boxed | (uint64_t(tag) << PackedAVal::TagShift) | payload;
+}
+
+static inline uint64_t boxPointer(PackedAVal::Tag tag, const void *ptr)
+{
+    const uint64_t payload = reinterpret_cast<uintptr_t>(ptr);
+    X_ASSERT((payload & ~PackedAVal::PayloadMask) == 0);
+    return box(tag, payload);
+}
+
+PackedAVal::PackedAVal(const AVal &v)
+{
+    if (v.isReference()) {
+        *this = PackedAVal(v.dereference());
+        return;
+    }
+
+    switch (v.type()) {
+    case AVal::INT:
+        bits = box(INT_TAG, uint32_t(v.intValue));
+        break;
+    case AVal::BOOL:
+        bits = box(BOOL_TAG, v.boolValue);
+        break;
+    case AVal::CHAR:
+        bits = box(CHAR_TAG, (unsigned char)v.charValue);
+        break;
+    case AVal::DOUBLE:
+        if (std::isnan(v.doubleValue)) {
+            bits = PackedCanonicalNaN;
+        } else {
+            memcpy(&bits, &v.doubleValue, sizeof(bits));
+        }
+        break;
+    case AVal::STRING:
+        bits = boxPointer(STRING_TAG, v.stringValue);
+        break;
+    case AVal::ARRAY:
+        bits = boxPointer(ARRAY_TAG, v.arrayValue);
+        break;
+    case AVal::FUNCTION:
+        bits = boxPointer(FUNCTION_TAG, v.functionValue);
+        break;
+    case AVal::FUNCTION_BUILTIN:
+        bits = boxPointer(FUNCTION_BUILTIN_TAG, reinterpret_cast<const void*>(v.builtinFunctionValue));
+        break;
+    default:
+        bits = box(UNDEFINED_TAG, 0);
+        break;
+    }
+}
+
+AVal::Type PackedAVal::type() const
+{
+    if ((bits & Boxed) != Boxed) {
+        return AVal::DOUBLE;
+    }
+    return packedTypes[(bits >> TagShift) & 7];
+}
+
+
+AVal AArray::get(size_t index) const
+{
+    switch (kind) {
+    case INT32:
+        return ints[index];
+    case DOUBLE:
+        return doubles[index];
+    case CHAR:
+        return chars[index];
+    default:
+        return array[index];
+    }
+}
+
+void AArray::set(size_t index, const AVal &value)
+{
+    if (value.isReference()) {
+        set(index, value.dereference());
+        return;
+    }
+    if (kind != GENERIC && kindOf(value) != kind) {
+        MemoryPool::convertArray(this, GENERIC);
+    }
+
+    switch (kind) {
+    case INT32:
+        ints[index] = value.intValue;
+        break;
+    case DOUBLE:
+        doubles[index] = value.doubleValue;
+        break;
+    case CHAR:
+        chars[index] = value.charValue;
+        break;
+    default:
+        MemoryPool::overwriteBarrier(array[index]);
+        array[index].store(value);
+        MemoryPool::writeBarrier(array[index], this);
+        break;
+    }
+}
+
+void AArray::push(const AVal &value)
+{
+    if (keys) {
+        insert(keys->next, value);
+        return;
+    }
+    append(value);
+}
+
+void AArray::append(const AVal &value)
+{
+    if (value.isReference()) {
+        append(value.dereference());
+        return;
+    }
+    if (count >= allocd) {
+        MemoryPool::growArray(this, (count + 1) * 2);
+    } else {
+        MemoryPool::makeWritable(this);
+    }
+    // Empty arrays take the storage of their first element
+    const Kind k = kindOf(value);
+    if (kind != k && (count == 0 || kind != GENERIC)) {
+        MemoryPool::convertArray(this, count == 0 ? k : GENERIC);
+    }
+
+    switch (kind) {
+    case INT32:
+        ints[count] = value.intValue;
+        break;
+    case DOUBLE:
+        doubles[count] = value.doubleValue;
+        break;
+    case CHAR:
+        chars[count] = value.charValue;
+        break;
+    default:
+        array[count].store(value);
+        MemoryPool::writeBarrier(array[count], this);
+        break;
+    }
+    // Publish the element after it is stored, the collector may be tracing the array
+    __atomic_store_n(&count, count + 1, __ATOMIC_RELEASE);
+}
+
+// static
+AArray::Kind AArray::kindOf(const AVal &value)
+{
+    switch (value.type()) {
+    case AVal::INT:
+        return INT32;
+    case AVal::DOUBLE:
+        return DOUBLE;
+    case AVal::CHAR:
+        return CHAR;
+    default:
+        return GENERIC;
+    }
+}
+
+long AArray::find(const AVal &key) const
+{
+    return keys ? keys->find(key) : -1;
+}
+
+void AArray::insert(const AVal &key, const AVal &value)
+{
+    MemoryPool::makeWritable(this);
+    keys->add(key);
+    append(value);
+}
+
+
+static inline uint32_t hashInt(int value)
+{
+    const uint32_t h = uint32_t(value) * 0x9E3779B1u;
+    return h ^ (h >> 16);
+}
+
+// FNV-1a
+static inline uint32_t hashChars(const char *str)
+{
+    uint32_t h = 2166136261u;
+    for (; *str; ++str) {
+        h = (h ^ (unsigned char)*str) * 16777619u;
+    }
+    return h;
+}
+
+uint32_t AString::hashValue()
+{
+    if (hash) {
+        return hash;
+    }
+    const uint32_t h = hashChars(chars());
+    if (!written) {
+        hash = h ? h : 1;
+    }
+    return h ? h : 1;
+}
+
+long AKeys::find(const AVal &key) const
+{
+    if (key.isReference()) {
+        return find(key.dereference());
+    }
+    if (!count) {
+        return -1;
+    }
+    const AVal &k = key;
+    const bool isString = k.isString();
+    if (!isString && !k.isInt()) {
+        return -1;
+    }
+    const uint32_t hash = isString ? k.stringValue->hashValue() : hashInt(k.intValue);
+    const char *str = isString ? k.stringValue->chars() : nullptr;
+    for (size_t i = hash & mask; slots[i]; i = (i + 1) & mask) {
+        const Key &e = keys[slots[i] - 1];
+        if (e.hash != hash) {
+            continue;
+        }
+        if (isString ? e.string && strcmp(e.string, str) == 0 : !e.string && e.number == k.intValue) {
+            return slots[i] - 1;
+        }
+    }
+    return -1;
+}
+
+void AKeys::add(const AVal &key)
+{
+    if (key.isReference()) {
+        add(key.dereference());
+        return;
+    }
+    X_ASSERT(refs == 1 && isKey(key) && find(key) < 0);
+    if (count >= allocd) {
+        allocd = (count + 1) * 2;
+        keys = (Key*)realloc(keys, allocd * sizeof(Key));
+    }
+    // The table is kept at most half full
+    if (count * 2 >= mask) {
+        const size_t size = std::max<size_t>(8, (mask + 1) * 2);
+        free(slots);
+        slots = (uint32_t*)calloc(size, sizeof(uint32_t));
+        mask = size - 1;
+        for (size_t p = 0; p < count; ++p) {
+            size_t i = keys[p].hash & mask;
+            while (slots[i]) {
+                i = (i + 1) & mask;
+            }
+            slots[i] = p + 1;
+        }
+    }
+
+    const AVal &k = key;
+    Key &e = keys[count];
+    if (k.isString()) {
+        e.string = strdup(k.stringValue->chars());
+        e.number = 0;
+        e.hash = k.stringValue->hashValue();
+    } else {
+        e.string = nullptr;
+        e.number = k.intValue;
+        e.hash = hashInt(k.intValue);
+        if (k.intValue >= next) {
+            next = k.intValue + 1;
+        }
+    }
+    size_t i = e.hash & mask;
+    while (slots[i]) {
+        i = (i + 1) & mask;
+    }
+    slots[i] = ++count;
+}
+
+AVal AKeys::key(size_t index) const
+{
+    const Key &e = keys[index];
+    if (e.string) {
+        return e.string;
+    }
+    return e.number;
+}
+
+AKeys *AKeys::clone() const
+{
+    AKeys *c = new AKeys(*this);
+    c->refs = 1;
+    if (keys) {
+        c->keys = (Key*)malloc(allocd * sizeof(Key));
+        memcpy(c->keys, keys, count * sizeof(Key));
+        for (size_t i = 0; i < count; ++i) {
+            if (keys[i].string) {
+                c->keys[i].string = strdup(keys[i].string);
+            }
+        }
+    }
+    if (slots) {
+        c->slots = (uint32_t*)malloc((mask + 1) * sizeof(uint32_t));
+        memcpy(c->slots, slots, (mask + 1) * sizeof(uint32_t));
+    }
+    return c;
+}
+
+// static
+void AKeys::release(AKeys *keys)
+{
+    // Maps are released by the sweeper threads, copies may share the keys
+    if (__atomic_sub_fetch(&keys->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+    for (size_t i = 0; i < keys->count; ++i) {
+        free(keys->keys[i].string);
+    }
+    free(keys->keys);
+    free(keys->slots);
+    delete keys;
+}
@@ -1,7 +1,8 @@
 #pragma once
 
 
-#include <unordered_set>
+#include <vector>
+#include <cstdint>
 
 
 class AVal;
@@ -14,17 +15,22 @@ class Environment;
 typedef AVal (*BuiltinCall)(const std::vector<Ast::Expression*> &, Environment *);
 
 struct AArray;
+struct AKeys;
 struct AString;
+class PackedAVal;
 
 
-extern std::unordered_set<AVal*> localAVals;
+// Root stack of values holding strings or arrays outside of the GC heap.
+// Each registered value knows its position, so both push and removal are O(1).
+// Slots of functions are scanned in the frame stack instead.
+extern std::vector<AVal*> localAVals;
 
 
 
 class AVal
 {
 public:
-    enum Type {
+    enum Type : unsigned char {
         UNDEFINED = 0,
         REFERENCE,
         INT,
@@ -37,15 +43,25 @@ public:
         FUNCTION_BUILTIN
     };
 
+    // Kind of location a REFERENCE points to
+    enum RefKind : unsigned char {
+        VALUE_REF = 0,
+        CHAR_REF,
+        ELEMENT_REF
+    };
+
     ~AVal();
     AVal();
     AVal(const AVal& v);
+    AVal(AVal&& v) noexcept;
+    AVal(const PackedAVal& v);
     AVal(AVal *value);
     AVal(int value);
     AVal(bool value);
     AVal(char value);
     AVal(double value);
     AVal(const char *value);
+    AVal(AString *value);
     AVal(BuiltinCall value);
     AVal(AArray *value);
     AVal(Ast::Function *value);
@@ -53,12 +69,18 @@ public:
     Type type() const;
     const char* typeStr() const;
     AVal& operator=(const AVal& v);
+    AVal& operator=(AVal&& v) noexcept;
 
     AVal copy() const;
     AVal dereference() const;
+    // Dereference without copying; char and array element references have
+    // no AVal to refer to and are returned as they are
+    const AVal &deref() const;
     void assign(const AVal &value);
 
-    static AVal createCharReference(char *value);
+    // Writes through the references make the string or the array writable first
+    static AVal createCharReference(AString *string, size_t index);
+    static AVal createElementReference(AArray *array, size_t index);
 
     bool isUndefined() const;
     bool isReference() const;
@@ -90,12 +112,31 @@ public:
 
     AVal convertTo(Type t) const;
 
-    bool _const = false;
-    bool _thrown = false;
-    bool _charref = false;
-    Type _type = UNDEFINED;
+    // Number of copies made by copy construction and copy assignment,
+    // tracked copies are the ones that had to touch the root stack
+    static size_t copies;
+    static size_t trackedCopies;
+
+    // Registered values keep 1 + index in localAVals
+    static const unsigned int Unrooted = 0;
+    // Values in the frame stack are never registered, see FrameStack
+    static const unsigned int Framed = (1u << 24) - 1;
+
+    // The header takes 8 bytes, the constructors initialize it
+    bool _const : 1;
+    bool _thrown : 1;
+    RefKind _refKind : 2;
+    Type _type : 4;
+    unsigned int _root : 24;
+    // Position of the char or element a CHAR_REF or ELEMENT_REF refers to
+    uint32_t _index;
+
     union {
         AVal *referenceValue;
+        // Element and char references keep the owner, the storage may be
+        // moved when it grows or when a shared copy is written
+        AArray *elementReferenceValue;
+        AString *charReferenceValue;
         int intValue;
         bool boolValue;
         char charValue;
@@ -105,23 +146,171 @@ public:
         AString *stringValue;
         AArray *arrayValue;
     };
+
+private:
+    explicit AVal(Type type);
 };
 
+// Registers and frame slots are copied a lot, a value must stay two words
+static_assert(sizeof(AVal) == 16, "AVal must be 16 bytes");
+
+// 8-byte NaN-boxed form of AVal used for array elements.
+// Doubles are stored as they are (NaNs canonicalized), other types are encoded
+// in the payload of a negative quiet NaN. References are stored dereferenced,
+// const and thrown state is not kept.
+class PackedAVal
+{
+public:
+    // Boxed values have all bits of Boxed set, 3 bits of tag follow
+    // and the low 48 bits hold the payload
+    static const uint64_t Boxed = 0xFFF8000000000000ULL;
+    static const uint64_t PayloadMask = 0x0000FFFFFFFFFFFFULL;
+    static const int TagShift = 48;
+
+    enum Tag {
+        UNDEFINED_TAG = 0,
+        INT_TAG,
+        BOOL_TAG,
+        CHAR_TAG,
+        STRING_TAG,
+        ARRAY_TAG,
+        FUNCTION_TAG,
+        FUNCTION_BUILTIN_TAG
+    };
+
+    PackedAVal() : bits(Boxed | (uint64_t(UNDEFINED_TAG) << TagShift)) {}
+    PackedAVal(const AVal &v);
+
+    AVal::Type type() const;
+
+    AString *stringValue() const {
+        return hasTag(STRING_TAG) ? reinterpret_cast<AString*>(bits & PayloadMask) : nullptr;
+    }
+    AArray *arrayValue() const {
+        return hasTag(ARRAY_TAG) ? reinterpret_cast<AArray*>(bits & PayloadMask) : nullptr;
+    }
+
+    // Elements of generic arrays are read by the marker thread while they are stored.
+    // The store publishes the object the value refers to, the load sees it initialized.
+    PackedAVal load() const {
+        PackedAVal v;
+        v.bits = __atomic_load_n(&bits, __ATOMIC_ACQUIRE);
+        return v;
+    }
+    void store(const PackedAVal &v) {
+        __atomic_store_n(&bits, v.bits, __ATOMIC_RELEASE);
+    }
+
+    uint64_t bits;
+
+private:
+    bool hasTag(Tag tag) const {
+        return (bits >> TagShift) == ((Boxed >> TagShift) | tag);
+    }
+};
+
+// Elements live in a separate buffer owned by the memory pool, so the
+// AArray itself does not move when the buffer is replaced or grown.
+// Arrays holding only ints, doubles or chars store them unboxed,
+// storing a value of other type converts the array to generic storage.
+// Associative arrays (maps) additionally have keys, element i belongs to key i.
 struct AArray {
+    enum Kind : unsigned char {
+        GENERIC = 0,
+        INT32,
+        DOUBLE,
+        CHAR
+    };
+
     size_t count = 0;
     size_t allocd = 0;
     void *mem = nullptr;
-    AVal array[1];
+    union {
+        PackedAVal *array = nullptr;
+        int *ints;
+        double *doubles;
+        char *chars;
+    };
+    Kind kind = GENERIC;
+    // Set for maps only
+    AKeys *keys = nullptr;
 
-    static size_t allocSize(size_t elements) {
-        return sizeof(AArray) + sizeof(AVal) * (elements - 1);
+    AVal get(size_t index) const;
+    // Overwrites an existing element, elements must be writable, see MemoryPool::makeWritable
+    void set(size_t index, const AVal &value);
+    // Appends the element, the buffer grows when it is full.
+    // Maps append it under the int key following the largest one.
+    void push(const AVal &value);
+
+    // Position of the element with the key in a map, -1 when there is none
+    long find(const AVal &key) const;
+    // Appends the element to a map, the key must not be present
+    void insert(const AVal &key, const AVal &value);
+
+    // Storage an array holding only values like this one can use
+    static Kind kindOf(const AVal &value);
+    static size_t elementSize(Kind kind) {
+        static const size_t sizes[] = {sizeof(PackedAVal), sizeof(int), sizeof(double), sizeof(char)};
+        return sizes[kind];
+    }
+
+private:
+    void append(const AVal &value);
+};
+
+// Insertion ordered keys of a map, positions of keys are found through
+// an open addressing table. Keys are owned outside of the GC heap and
+// shared by copies of the map until one of them is written to.
+struct AKeys {
+    struct Key {
+        // Own copy of a string key, null for int keys
+        char *string;
+        int number;
+        uint32_t hash;
+    };
+
+    size_t refs = 1;
+    size_t count = 0;
+    size_t allocd = 0;
+    Key *keys = nullptr;
+    // Positions of keys plus one, 0 marks a free slot
+    uint32_t *slots = nullptr;
+    size_t mask = 0;
+    // Int key push() appends with
+    int next = 0;
+
+    // Values which may be used as keys
+    static bool isKey(const AVal &key) {
+        return key.isInt() || key.isString();
     }
+
+    long find(const AVal &key) const;
+    void add(const AVal &key);
+    AVal key(size_t index) const;
+
+    AKeys *clone() const;
+    // Drops a reference, the last one frees the keys
+    static void release(AKeys *keys);
 };
 
+// Copies of a string refer to the characters of their base until
+// they are written to, the shared base is then left untouched
 struct AString {
     void *mem = nullptr;
+    AString *base = nullptr;
+    // Characters are referred to by copies and must not be written
+    bool shared = false;
+    // Characters were made writable, their hash is not cached anymore
+    bool written = false;
+    // Cached by hashValue(), 0 when not computed yet
+    uint32_t hash = 0;
     char string[1];
 
+    const char *chars() const {
+        return base ? base->string : string;
+    }
+    uint32_t hashValue();
+
     static size_t allocSize(size_t elements) {
         return sizeof(AString) + sizeof(char) * (elements - 1);
     }
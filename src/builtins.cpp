@@ -4,6 +4,7 @@
 #include "environment.h"
 #include "memorypool.h"
 #include "evaluator.h"
+#include "kernels.h"
 
 #include <iostream>
 #include <algorithm>
@@ -373,21 +374,19 @@ AVal doBuiltInArray(const std::vector<Ast::Expression*> &arguments, Environment
         THROW("Array size cannot be negative.");
     }
 
-    void *mem;
-    AArray *a = (AArray*)MemoryPool::alloc(AArray::allocSize(size), &mem);
-    a->mem = mem;
-    a->count = 0;
-    a->allocd = size;
+    if (arguments.size() < 2) {
+        return MemoryPool::allocArray(size);
+    }
 
-    if (arguments.size() == 2) {
-        AVal initializer = ex(arguments[1], envir);
-        for (int i = 0; i < size; ++i) {
-            a->array[i] = initializer.copy();
-        }
-        a->count = size;
+    AVal initializer = ex(arguments[1], envir).dereference();
+    AArray *a = MemoryPool::allocArray(size, AArray::kindOf(initializer));
+    // Keep the array rooted while copying the initializer allocates
+    AVal result(a);
+    for (int i = 0; i < size; ++i) {
+        a->push(initializer.copy());
     }
 
-    return a;
+    return result;
 }
 
 AVal doBuiltInCount(const std::vector<Ast::Expression*> &arguments, Environment *envir)
@@ -402,8 +401,58 @@ AVal doBuiltInCount(const std::vector<Ast::Expression*> &arguments, Environment
     } else if (arr.isString()) {
         return int(strlen(arr.toString()));
     } else {
-        THROW("count() argument must be of type array or string.");
+        THROW("count() argument must be of type array, map or string.");
+    }
+}
+
+AVal doBuiltInNewMap(const std::vector<Ast::Expression*> &arguments, Environment *)
+{
+    if (!arguments.empty()) {
+        THROW("Map() takes no arguments.");
     }
+
+    return MemoryPool::allocMap();
+}
+
+AVal doBuiltInKeys(const std::vector<Ast::Expression*> &arguments, Environment *envir)
+{
+    if (arguments.size() != 1) {
+        THROW("keys() takes one argument.");
+    }
+
+    AVal arr = ex(arguments[0], envir);
+    if (!arr.isArray()) {
+        THROW("keys() argument must be of type map or array.");
+    }
+
+    const AArray *a = arr.toArray();
+    AArray *k = MemoryPool::allocArray(a->count, a->keys ? AArray::GENERIC : AArray::INT32);
+    AVal result(k);
+    for (size_t i = 0; i < a->count; ++i) {
+        k->push(a->keys ? a->keys->key(i) : AVal(int(i)));
+    }
+    return result;
+}
+
+AVal doBuiltInHasKey(const std::vector<Ast::Expression*> &arguments, Environment *envir)
+{
+    if (arguments.size() != 2) {
+        THROW("hasKey() takes two arguments.");
+    }
+
+    AVal arr = ex(arguments[0], envir);
+    CHECKTHROWN(arr)
+    AVal key = ex(arguments[1], envir).dereference();
+    CHECKTHROWN(key)
+    if (!arr.isArray()) {
+        THROW("hasKey() argument 1 must be of type map or array.");
+    }
+
+    const AArray *a = arr.toArray();
+    if (a->keys) {
+        return a->find(key) >= 0;
+    }
+    return key.isInt() && key.toInt() >= 0 && key.toInt() < a->count;
 }
 
 AVal doBuiltInPush(const std::vector<Ast::Expression*> &arguments, Environment *envir)
@@ -413,32 +462,435 @@ AVal doBuiltInPush(const std::vector<Ast::Expression*> &arguments, Environment *
     }
 
     AVal arr = ex(arguments[0], envir);
-    if (!arr.isReference() || !arr.toReference()->isArray()) {
+    if (!arr.isReference() || !arr.isArray()) {
         THROW("push() argument 1 must be reference to type array.");
     }
 
     AVal value = ex(arguments[1], envir).dereference();
-    AVal *ref = arr.toReference();
-    AArray *ar = ref->toArray();
-
-    if (ar->count >= ar->allocd) {
-        const int newallocd = (ar->count + 1) * 2;
-        void *mem;
-        AArray *tmp = (AArray*)MemoryPool::alloc(AArray::allocSize(newallocd), &mem);
-        tmp->mem = mem;
-        for (size_t i = 0; i < ar->count; ++i) {
-            tmp->array[i] = ar->array[i];
+    arr.toArray()->push(value);
+    return AVal();
+}
+
+AVal doBuiltInSum(const std::vector<Ast::Expression*> &arguments, Environment *envir)
+{
+    if (arguments.size() != 1) {
+        THROW("sum() takes one argument.");
+    }
+
+    AVal arr = ex(arguments[0], envir);
+    if (!arr.isArray()) {
+        THROW("sum() argument must be of type array.");
+    }
+
+    const AArray *a = arr.toArray();
+    switch (a->kind) {
+    case AArray::INT32:
+        return Kernels::sum(a->ints, a->count);
+    case AArray::DOUBLE:
+        return Kernels::sum(a->doubles, a->count);
+    default:
+        break;
+    }
+    if (a->count == 0) {
+        return 0;
+    }
+    AVal s = a->get(0);
+    for (size_t i = 1; i < a->count; ++i) {
+        s = binaryOp(Ast::BinaryOperator::Plus, s, a->get(i));
+    }
+    return s;
+}
+
+// Smaller of two values, or the smallest element of an array
+static AVal extremum(const std::vector<Ast::Expression*> &arguments, Environment *envir, Ast::BinaryOperator::Op op)
+{
+    const char *name = op == Ast::BinaryOperator::LessThan ? "min" : "max";
+    if (arguments.size() == 2) {
+        AVal a = ex(arguments[0], envir).dereference();
+        CHECKTHROWN(a)
+        AVal b = ex(arguments[1], envir).dereference();
+        CHECKTHROWN(b)
+        return binaryOp(op, a, b).toBool() ? a : b;
+    }
+    if (arguments.size() != 1) {
+        THROW2("%s() takes one or two arguments.", name);
+    }
+
+    AVal arr = ex(arguments[0], envir);
+    if (!arr.isArray()) {
+        THROW2("%s() argument must be of type array.", name);
+    }
+    const AArray *a = arr.toArray();
+    if (a->count == 0) {
+        return AVal();
+    }
+    const bool smallest = op == Ast::BinaryOperator::LessThan;
+    switch (a->kind) {
+    case AArray::INT32:
+        return smallest ? Kernels::min(a->ints, a->count) : Kernels::max(a->ints, a->count);
+    case AArray::DOUBLE:
+        return smallest ? Kernels::min(a->doubles, a->count) : Kernels::max(a->doubles, a->count);
+    default:
+        break;
+    }
+    AVal m = a->get(0);
+    for (size_t i = 1; i < a->count; ++i) {
+        AVal v = a->get(i);
+        if (binaryOp(op, v, m).toBool()) {
+            m = v;
+        }
+    }
+    return m;
+}
+
+AVal doBuiltInMin(const std::vector<Ast::Expression*> &arguments, Environment *envir)
+{
+    return extremum(arguments, envir, Ast::BinaryOperator::LessThan);
+}
+
+AVal doBuiltInMax(const std::vector<Ast::Expression*> &arguments, Environment *envir)
+{
+    return extremum(arguments, envir, Ast::BinaryOperator::GreaterThan);
+}
+
+// Position of the first element equal to value, -1 when there is none
+static long position(const AArray *a, const AVal &value)
+{
+    if (a->kind == AArray::INT32 && value.isInt()) {
+        return Kernels::indexOf(a->ints, a->count, value.toInt());
+    }
+    if (a->kind == AArray::DOUBLE && (value.isDouble() || value.isInt())) {
+        return Kernels::indexOf(a->doubles, a->count, value.toDouble());
+    }
+    if (a->kind == AArray::CHAR && value.isChar()) {
+        const void *c = memchr(a->chars, value.toChar(), a->count);
+        return c ? (const char*)c - a->chars : -1;
+    }
+    for (size_t i = 0; i < a->count; ++i) {
+        if (binaryOp(Ast::BinaryOperator::Equal, a->get(i), value).toBool()) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+AVal doBuiltInIndexOf(const std::vector<Ast::Expression*> &arguments, Environment *envir)
+{
+    if (arguments.size() != 2) {
+        THROW("indexOf() takes two arguments.");
+    }
+
+    AVal arr = ex(arguments[0], envir);
+    CHECKTHROWN(arr)
+    AVal value = ex(arguments[1], envir).dereference();
+    CHECKTHROWN(value)
+
+    if (arr.isString()) {
+        const char *s = arr.toString();
+        if (value.isChar()) {
+            const char *c = value.toChar() ? strchr(s, value.toChar()) : nullptr;
+            return c ? int(c - s) : -1;
+        }
+        for (size_t i = 0; s[i]; ++i) {
+            if (binaryOp(Ast::BinaryOperator::Equal, s[i], value).toBool()) {
+                return int(i);
+            }
         }
-        tmp->count = ar->count;
-        tmp->allocd = newallocd;
-        ar = tmp;
-        ref->arrayValue = ar;
+        return -1;
+    }
+    if (!arr.isArray()) {
+        THROW("indexOf() argument 1 must be of type array or string.");
     }
 
-    ar->array[ar->count++] = value;
+    // Maps return the key of the element
+    const AArray *a = arr.toArray();
+    const long pos = position(a, value);
+    if (a->keys && pos >= 0) {
+        return a->keys->key(pos);
+    }
+    return int(pos);
+}
+
+AVal doBuiltInFill(const std::vector<Ast::Expression*> &arguments, Environment *envir)
+{
+    if (arguments.size() != 2) {
+        THROW("fill() takes two arguments.");
+    }
+
+    AVal arr = ex(arguments[0], envir);
+    if (!arr.isArray()) {
+        THROW("fill() argument 1 must be of type array.");
+    }
+    AVal value = ex(arguments[1], envir).dereference();
+    CHECKTHROWN(value)
+
+    AArray *a = arr.toArray();
+    MemoryPool::makeWritable(a);
+    if (a->kind != AArray::GENERIC && AArray::kindOf(value) != a->kind) {
+        MemoryPool::convertArray(a, AArray::GENERIC);
+    }
+    switch (a->kind) {
+    case AArray::INT32:
+        Kernels::fill(a->ints, a->count, value.toInt());
+        break;
+    case AArray::DOUBLE: {
+        const double d = value.toDouble();
+        uint64_t bits;
+        memcpy(&bits, &d, sizeof(bits));
+        Kernels::fill((uint64_t*)a->doubles, a->count, bits);
+        break;
+    }
+    case AArray::CHAR:
+        memset(a->chars, value.toChar(), a->count);
+        break;
+    default: {
+        // Boxed elements are stored one by one, the marker thread may be reading them
+        const PackedAVal packed(value);
+        for (size_t i = 0; i < a->count; ++i) {
+            MemoryPool::overwriteBarrier(a->array[i]);
+            a->array[i].store(packed);
+        }
+        if (a->count) {
+            MemoryPool::writeBarrier(a->array[0], a);
+        }
+        break;
+    }
+    }
+    return AVal();
+}
+
+// Number of elements of an array or characters of a string, -1 for other values
+static int length(const AVal &v)
+{
+    if (v.isArray()) {
+        return int(v.toArray()->count);
+    } else if (v.isString()) {
+        return int(strlen(v.toString()));
+    }
+    return -1;
+}
+
+// Key of element i of a map, other values are indexed by position
+static AVal keyOf(const AVal &arr, int i)
+{
+    if (arr.isArray() && arr.toArray()->keys) {
+        return arr.toArray()->keys->key(i);
+    }
+    return i;
+}
+
+// Element i of an array or string as argument n of f, references are passed when f takes one
+static AVal element(const AVal &arr, int i, const AVal &f, int n)
+{
+    bool ref = false;
+    if (f.isFunction()) {
+        const std::vector<Ast::Variable*> &params = f.toFunction()->parameters()->variables;
+        ref = n < params.size() && params[n]->ref && !params[n]->isconst;
+    }
+    return subscript(arr, i, ref);
+}
+
+AVal doBuiltInSwap(const std::vector<Ast::Expression*> &arguments, Environment *envir)
+{
+    if (arguments.size() != 2) {
+        THROW("swap() takes two arguments.");
+    }
+
+    AVal refs[2];
+    for (int i = 0; i < 2; ++i) {
+        setExFlag(ReturnLValue);
+        refs[i] = ex(arguments[i], envir);
+        clearExFlag(ReturnLValue);
+        CHECKTHROWN(refs[i])
+        if (!refs[i].isReference()) {
+            THROW2("Argument %d expects reference!", i);
+        }
+    }
+    AVal &a = refs[0];
+    AVal &b = refs[1];
+
+    AVal tmp = a.dereference();
+    for (AVal *dest : {&a, &b}) {
+        const AVal value = dest == &a ? b.dereference() : tmp;
+        if (dest->_refKind != AVal::VALUE_REF) {
+            // String or array subscript
+            dest->assign(value);
+        } else {
+            CHECKTHROWN(assignToReference(dest->toReference(), value))
+        }
+    }
+    return AVal();
+}
+
+AVal doBuiltInCopy(const std::vector<Ast::Expression*> &arguments, Environment *envir)
+{
+    if (arguments.size() != 1) {
+        THROW("copy() takes one argument.");
+    }
+
+    AVal value = ex(arguments[0], envir);
+    CHECKTHROWN(value)
+    return value.dereference().copy();
+}
+
+AVal merge(const AVal &a, const AVal &b)
+{
+    const int countA = length(a);
+    const int countB = length(b);
+    if (countA < 0 || countB < 0) {
+        THROW("merge() arguments must be of type array or string.");
+    }
+
+    const AArray *arrA = a.isArray() ? a.toArray() : nullptr;
+    const AArray *arrB = b.isArray() ? b.toArray() : nullptr;
+    if ((arrA && arrA->keys) || (arrB && arrB->keys)) {
+        if (!arrA || !arrB) {
+            THROW("merge() of a map takes a map or array.");
+        }
+        // Union of keys, values of the first argument are kept
+        AArray *m = MemoryPool::allocMap(countA + countB);
+        AVal result(m);
+        for (const AVal *src : {&a, &b}) {
+            const AArray *arr = src->toArray();
+            for (size_t i = 0; i < arr->count; ++i) {
+                AVal key = keyOf(*src, i);
+                if (m->find(key) < 0) {
+                    m->insert(key, arr->get(i));
+                }
+            }
+        }
+        return result;
+    }
+    if (arrA && arrB && arrA->kind == arrB->kind && arrA->kind != AArray::GENERIC) {
+        // Unboxed elements are copied as they are
+        AArray *m = MemoryPool::allocArray(countA + countB, arrA->kind);
+        const size_t size = AArray::elementSize(m->kind);
+        if (countA) {
+            memcpy(m->chars, arrA->chars, countA * size);
+        }
+        if (countB) {
+            memcpy(m->chars + countA * size, arrB->chars, countB * size);
+        }
+        m->count = countA + countB;
+        return m;
+    }
+
+    AArray *m = MemoryPool::allocArray(countA + countB);
+    // Keep the result rooted while pushing allocates
+    AVal result(m);
+    for (const AVal *src : {&a, &b}) {
+        const int c = src == &a ? countA : countB;
+        for (int i = 0; i < c; ++i) {
+            m->push(subscript(*src, i, false));
+        }
+    }
+    return result;
+}
+
+AVal doBuiltInMerge(const std::vector<Ast::Expression*> &arguments, Environment *envir)
+{
+    if (arguments.size() != 2) {
+        THROW("merge() takes two arguments.");
+    }
+
+    AVal a = ex(arguments[0], envir).dereference();
+    CHECKTHROWN(a)
+    AVal b = ex(arguments[1], envir).dereference();
+    CHECKTHROWN(b)
+    return merge(a, b);
+}
+
+AVal doBuiltInForEach(const std::vector<Ast::Expression*> &arguments, Environment *envir)
+{
+    if (arguments.size() != 2) {
+        THROW("forEach() takes two arguments.");
+    }
+
+    AVal arr = ex(arguments[0], envir).dereference();
+    CHECKTHROWN(arr)
+    AVal f = ex(arguments[1], envir).dereference();
+    CHECKTHROWN(f)
+    const int c = length(arr);
+    if (c < 0) {
+        THROW("forEach() argument 1 must be of type array or string.");
+    }
+
+    std::vector<AVal> args(2);
+    for (int i = 0; i < c; ++i) {
+        args[0] = element(arr, i, f, 0);
+        CHECKTHROWN(args[0])
+        args[1] = keyOf(arr, i);
+        AVal r = call(f, args, envir);
+        CHECKTHROWN(r)
+        // Callbacks stop the loop by returning a value
+        if (!r.isUndefined()) {
+            break;
+        }
+    }
     return AVal();
 }
 
+AVal doBuiltInReduce(const std::vector<Ast::Expression*> &arguments, Environment *envir)
+{
+    if (arguments.size() != 2) {
+        THROW("reduce() takes two arguments.");
+    }
+
+    AVal arr = ex(arguments[0], envir).dereference();
+    CHECKTHROWN(arr)
+    AVal f = ex(arguments[1], envir).dereference();
+    CHECKTHROWN(f)
+    const int c = length(arr);
+    if (c < 0) {
+        THROW("reduce() argument 1 must be of type array or string.");
+    }
+
+    std::vector<AVal> args(2);
+    args[0] = element(arr, 0, f, 0);
+    CHECKTHROWN(args[0])
+    for (int i = 1; i < std::max(c, 2); ++i) {
+        args[1] = element(arr, i, f, 1);
+        CHECKTHROWN(args[1])
+        args[0] = call(f, args, envir);
+        CHECKTHROWN(args[0])
+    }
+    return args[0];
+}
+
+AVal doBuiltInMap(const std::vector<Ast::Expression*> &arguments, Environment *envir)
+{
+    if (arguments.size() != 2) {
+        THROW("map() takes two arguments.");
+    }
+
+    AVal arr = ex(arguments[0], envir).dereference();
+    CHECKTHROWN(arr)
+    AVal f = ex(arguments[1], envir).dereference();
+    CHECKTHROWN(f)
+    const int c = length(arr);
+    if (c < 0) {
+        THROW("map() argument 1 must be of type array or string.");
+    }
+
+    // Maps are mapped to maps with the same keys
+    const bool isMap = arr.isArray() && arr.toArray()->keys;
+    AArray *m = isMap ? MemoryPool::allocMap(c) : MemoryPool::allocArray(c);
+    AVal result(m);
+    std::vector<AVal> args(1);
+    for (int i = 0; i < c; ++i) {
+        args[0] = element(arr, i, f, 0);
+        CHECKTHROWN(args[0])
+        AVal r = call(f, args, envir);
+        CHECKTHROWN(r)
+        if (isMap) {
+            m->insert(keyOf(arr, i), r);
+        } else {
+            m->push(r);
+        }
+    }
+    return result;
+}
+
 void registerBuiltins(Environment* e)
 {
     e->set("typeof", &doBuiltInTypeof);
@@ -452,9 +904,23 @@ void registerBuiltins(Environment* e)
     e->set("gc", &doBuiltInGC);
     e->set("exit", &doBuiltInExit);
     e->set("Array", &doBuiltInArray);
+    e->set("Map", &doBuiltInNewMap);
+    e->set("keys", &doBuiltInKeys);
+    e->set("hasKey", &doBuiltInHasKey);
     e->set("count", &doBuiltInCount);
     e->set("rand", &doBuiltInRand);
     e->set("__push_internal", &doBuiltInPush);
+    e->set("sum", &doBuiltInSum);
+    e->set("min", &doBuiltInMin);
+    e->set("max", &doBuiltInMax);
+    e->set("indexOf", &doBuiltInIndexOf);
+    e->set("fill", &doBuiltInFill);
+    e->set("swap", &doBuiltInSwap);
+    e->set("copy", &doBuiltInCopy);
+    e->set("merge", &doBuiltInMerge);
+    e->set("forEach", &doBuiltInForEach);
+    e->set("reduce", &doBuiltInReduce);
+    e->set("map", &doBuiltInMap);
 }
 
 }
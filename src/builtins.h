@@ -21,6 +21,22 @@ namespace Evaluator
     // Arrays
     AVal doBuiltInArray(const std::vector<Ast::ExpressionList*> &, Environment *);
     AVal doBuiltInCount(const std::vector<Ast::ExpressionList*> &, Environment *);
+    AVal doBuiltInNewMap(const std::vector<Ast::Expression*> &, Environment *);
+    AVal doBuiltInKeys(const std::vector<Ast::Expression*> &, Environment *);
+    AVal doBuiltInHasKey(const std::vector<Ast::Expression*> &, Environment *);
     AVal doBuiltInPush(const std::vector<Ast::Expression*> &, Environment *);
+    AVal doBuiltInSum(const std::vector<Ast::Expression*> &, Environment *);
+    AVal doBuiltInMin(const std::vector<Ast::Expression*> &, Environment *);
+    AVal doBuiltInMax(const std::vector<Ast::Expression*> &, Environment *);
+    AVal doBuiltInIndexOf(const std::vector<Ast::Expression*> &, Environment *);
+    AVal doBuiltInFill(const std::vector<Ast::Expression*> &, Environment *);
+    AVal doBuiltInSwap(const std::vector<Ast::Expression*> &, Environment *);
+    AVal doBuiltInCopy(const std::vector<Ast::Expression*> &, Environment *);
+    AVal doBuiltInMerge(const std::vector<Ast::Expression*> &, Environment *);
+    AVal doBuiltInForEach(const std::vector<Ast::Expression*> &, Environment *);
+    AVal doBuiltInReduce(const std::vector<Ast::Expression*> &, Environment *);
+    AVal doBuiltInMap(const std::vector<Ast::Expression*> &, Environment *);
+
+    AVal merge(const AVal &a, const AVal &b);
 
 }
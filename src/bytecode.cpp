@@ -0,0 +1,363 @@
+#include "bytecode.h"
+#include "common.h"
+
+#include <algorithm>
+
+namespace Bytecode
+{
+
+class Compiler
+{
+public:
+    Compiler(Chunk *chunk, bool function)
+        : chunk(chunk)
+        , function(function)
+    {
+    }
+
+    void statement(Ast::Node *p);
+    int expression(Ast::Node *p);
+
+    void finish()
+    {
+        emit(End);
+    }
+
+private:
+    struct Loop {
+        int continueTarget;
+        std::vector<int> breaks;
+    };
+
+    int emit(Op op, int a = 0, int b = 0, int c = 0, Ast::Node *node = nullptr, int arg = 0)
+    {
+        chunk->code.push_back({ (unsigned char)op, (unsigned char)arg, Ast::Specialization::None, a, b, c, node });
+        return chunk->code.size() - 1;
+    }
+
+    int here() const
+    {
+        return chunk->code.size();
+    }
+
+    int reg()
+    {
+        chunk->registers = std::max(chunk->registers, top + 1);
+        return top++;
+    }
+
+    int constant(const AVal &v)
+    {
+        chunk->constants.push_back(v);
+        return chunk->constants.size() - 1;
+    }
+
+    int eval(Ast::Node *p);
+    void getVar(int r, Ast::Node *var);
+    void setVar(int r, Ast::Node *var);
+    void loopBody(Ast::StatementList *body, int continueTarget, std::vector<int> &breaks);
+    int incDec(Ast::UnaryOperator *v);
+    int call(Ast::FunctionCall *v, Op op);
+
+    Chunk *chunk;
+    bool function;
+    int top = 0;
+    std::vector<Loop> loops;
+};
+
+void Compiler::getVar(int r, Ast::Node *var)
+{
+    const int slot = static_cast<Ast::Variable*>(var)->slot;
+    if (slot >= 0) {
+        emit(GetLocal, r, slot);
+    } else {
+        emit(GetVar, r, 0, 0, var);
+    }
+}
+
+void Compiler::setVar(int r, Ast::Node *var)
+{
+    const int slot = static_cast<Ast::Variable*>(var)->slot;
+    if (slot >= 0) {
+        emit(SetLocal, r, slot);
+    } else {
+        emit(SetVar, r, 0, 0, var);
+    }
+}
+
+int Compiler::eval(Ast::Node *p)
+{
+    const int r = reg();
+    const int at = emit(Eval, r, -1, -1, p);
+    if (!loops.empty()) {
+        loops.back().breaks.push_back(at);
+        chunk->code[at].c = loops.back().continueTarget;
+    }
+    return r;
+}
+
+void Compiler::loopBody(Ast::StatementList *body, int continueTarget, std::vector<int> &breaks)
+{
+    loops.push_back({ continueTarget, {} });
+    statement(body);
+    breaks.insert(breaks.end(), loops.back().breaks.begin(), loops.back().breaks.end());
+    loops.pop_back();
+}
+
+int Compiler::incDec(Ast::UnaryOperator *v)
+{
+    const bool plus = v->op == Ast::UnaryOperator::PreIncrement || v->op == Ast::UnaryOperator::PostIncrement;
+    const bool post = v->op == Ast::UnaryOperator::PostIncrement || v->op == Ast::UnaryOperator::PostDecrement;
+
+    const int val = reg();
+    getVar(val, v->expr());
+    const int one = reg();
+    emit(LoadConst, one, constant(1));
+    const int res = reg();
+    emit(BinOp, res, val, one, nullptr, plus ? Ast::BinaryOperator::Plus : Ast::BinaryOperator::Minus);
+    setVar(res, v->expr());
+    return post ? val : res;
+}
+
+int Compiler::call(Ast::FunctionCall *v, Op op)
+{
+    int func;
+    if (v->function()->type() == Ast::Node::VariableT && static_cast<Ast::Variable*>(v->function())->slot < 0) {
+        func = reg();
+        emit(GetCallee, func, 0, 0, v);
+    } else {
+        func = expression(v->function());
+    }
+    const int r = reg();
+    emit(op, r, func, 0, v);
+    return r;
+}
+
+int Compiler::expression(Ast::Node *p)
+{
+    if (!p) {
+        const int r = reg();
+        emit(LoadConst, r, constant(AVal()));
+        return r;
+    }
+
+    switch (p->type()) {
+    case Ast::Node::UndefinedLiteralT: {
+        const int r = reg();
+        emit(LoadConst, r, constant(AVal()));
+        return r;
+    }
+
+    case Ast::Node::IntegerLiteralT: {
+        const int r = reg();
+        emit(LoadConst, r, constant(p->as<Ast::IntegerLiteral*>()->value));
+        return r;
+    }
+
+    case Ast::Node::BoolLiteralT: {
+        const int r = reg();
+        emit(LoadConst, r, constant(p->as<Ast::BoolLiteral*>()->value));
+        return r;
+    }
+
+    case Ast::Node::DoubleLiteralT: {
+        const int r = reg();
+        emit(LoadConst, r, constant(p->as<Ast::DoubleLiteral*>()->value));
+        return r;
+    }
+
+    case Ast::Node::CharLiteralT: {
+        const int r = reg();
+        emit(LoadConst, r, constant(p->as<Ast::CharLiteral*>()->value));
+        return r;
+    }
+
+    case Ast::Node::ConstantLiteralT: {
+        const int r = reg();
+        emit(LoadConst, r, constant(p->as<Ast::ConstantLiteral*>()->value()));
+        return r;
+    }
+
+    case Ast::Node::VariableT: {
+        const int r = reg();
+        getVar(r, p);
+        return r;
+    }
+
+    case Ast::Node::ArraySubscriptT: {
+        Ast::ArraySubscript *v = p->as<Ast::ArraySubscript*>();
+        const int ind = expression(v->expression());
+        const int src = expression(v->source());
+        const int r = reg();
+        emit(Index, r, src, ind);
+        return r;
+    }
+
+    case Ast::Node::AssignmentT: {
+        Ast::Assignment *v = p->as<Ast::Assignment*>();
+        const int r = expression(v->expression());
+        if (v->destination()->type() == Ast::Node::VariableT) {
+            setVar(r, v->destination());
+        } else {
+            emit(Assign, r, 0, 0, v->destination());
+        }
+        return r;
+    }
+
+    case Ast::Node::FunctionCallT:
+        return call(p->as<Ast::FunctionCall*>(), Call);
+
+    case Ast::Node::UnaryOperatorT: {
+        Ast::UnaryOperator *v = p->as<Ast::UnaryOperator*>();
+        switch (v->op) {
+        case Ast::UnaryOperator::Not: {
+            const int e = expression(v->expr());
+            const int r = reg();
+            emit(Not, r, e);
+            return r;
+        }
+        case Ast::UnaryOperator::Minus: {
+            const int zero = reg();
+            emit(LoadConst, zero, constant(0));
+            const int e = expression(v->expr());
+            const int r = reg();
+            emit(BinOp, r, zero, e, nullptr, Ast::BinaryOperator::Minus);
+            return r;
+        }
+        default:
+            if (v->expr()->type() == Ast::Node::VariableT) {
+                return incDec(v);
+            }
+            return eval(p);
+        }
+    }
+
+    case Ast::Node::BinaryOperatorT: {
+        Ast::BinaryOperator *v = p->as<Ast::BinaryOperator*>();
+        const int l = expression(v->left());
+        const int r = expression(v->right());
+        const int res = reg();
+        emit(BinOp, res, l, r, nullptr, v->op);
+        return res;
+    }
+
+    default:
+        return eval(p);
+    }
+}
+
+void Compiler::statement(Ast::Node *p)
+{
+    if (!p) {
+        return;
+    }
+
+    const int savedTop = top;
+
+    switch (p->type()) {
+    case Ast::Node::StatementListT:
+        for (Ast::Statement *s : p->as<Ast::StatementList*>()->statements) {
+            statement(s);
+        }
+        break;
+
+    case Ast::Node::IfT: {
+        Ast::If *v = p->as<Ast::If*>();
+        const int cond = expression(v->condition());
+        const int jumpElse = emit(JumpIfFalse, cond);
+        top = savedTop;
+        statement(v->thenStatement());
+        const int jumpEnd = emit(Jump);
+        chunk->code[jumpElse].b = here();
+        statement(v->elseStatement());
+        chunk->code[jumpEnd].b = here();
+        break;
+    }
+
+    case Ast::Node::WhileT: {
+        Ast::While *v = p->as<Ast::While*>();
+        std::vector<int> breaks;
+        const int start = here();
+        breaks.push_back(emit(JumpIfFalse, expression(v->condition())));
+        top = savedTop;
+        loopBody(v->statement(), start, breaks);
+        emit(Jump, 0, start);
+        for (int b : breaks) {
+            chunk->code[b].b = here();
+        }
+        break;
+    }
+
+    case Ast::Node::ForT: {
+        Ast::For *v = p->as<Ast::For*>();
+        std::vector<int> breaks;
+        expression(v->init());
+        top = savedTop;
+        // continue skips the 'after' expression, same as in Evaluator::ex
+        const int start = here();
+        breaks.push_back(emit(JumpIfFalse, expression(v->cond())));
+        top = savedTop;
+        loopBody(v->statement(), start, breaks);
+        expression(v->after());
+        emit(Jump, 0, start);
+        for (int b : breaks) {
+            chunk->code[b].b = here();
+        }
+        break;
+    }
+
+    case Ast::Node::ReturnT:
+        // Only process return in functions
+        if (function) {
+            Ast::Node *e = p->as<Ast::Return*>()->expression();
+            if (e && e->type() == Ast::Node::FunctionCallT) {
+                emit(Return, call(e->as<Ast::FunctionCall*>(), TailCall));
+            } else {
+                emit(Return, expression(e));
+            }
+        }
+        break;
+
+    case Ast::Node::BreakT:
+        if (loops.empty()) {
+            eval(p);
+        } else {
+            loops.back().breaks.push_back(emit(Jump));
+        }
+        break;
+
+    case Ast::Node::ContinueT:
+        if (loops.empty()) {
+            eval(p);
+        } else {
+            emit(Jump, 0, loops.back().continueTarget);
+        }
+        break;
+
+    default:
+        expression(p);
+        break;
+    }
+
+    top = savedTop;
+}
+
+Chunk *compile(Ast::Node *statement)
+{
+    Chunk *chunk = new Chunk;
+    Compiler c(chunk, false);
+    c.statement(statement);
+    c.finish();
+    return chunk;
+}
+
+Chunk *compile(Ast::Function *func)
+{
+    Chunk *chunk = new Chunk;
+    Compiler c(chunk, true);
+    c.statement(func->statements());
+    c.finish();
+    return chunk;
+}
+
+} // namespace Bytecode
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "ast.h"
+#include "aval.h"
+
+#include <vector>
+
+namespace Bytecode
+{
+
+enum Op {
+    LoadConst,      // a = constants[b]
+    GetVar,         // a = variable node
+    SetVar,         // variable node = a
+    GetLocal,       // a = slots[b]
+    SetLocal,       // slots[b] = a
+    Assign,         // lvalue expression node = a
+    Index,          // a = b[c]
+    GetCallee,      // a = function called by call node
+    Call,           // a = b(arguments of call node)
+    TailCall,       // a = b(arguments of call node), the call may be left to the caller
+    Not,            // a = !b
+    BinOp,          // a = b <arg> c
+    Jump,           // goto b
+    JumpIfFalse,    // if (!a) goto b
+    Return,         // return a
+    Eval,           // a = ex(node); on break goto b, on continue goto c
+    End
+};
+
+struct Instruction {
+    unsigned char op;
+    unsigned char arg;
+    // Operand types BinOp and Index specialized for, see Ast::Specialization
+    Ast::Specialization spec;
+    int a;
+    int b;
+    int c;
+    Ast::Node *node;
+};
+
+struct Chunk {
+    std::vector<Instruction> code;
+    std::vector<AVal> constants;
+    int registers = 0;
+};
+
+// Top-level statement
+Chunk *compile(Ast::Node *statement);
+// Function body
+Chunk *compile(Ast::Function *func);
+
+} // namespace Bytecode
@@ -2,21 +2,189 @@
 #include "environment.h"
 #include "ast.h"
 
+#include <new>
+#include <algorithm>
+
+#include <unistd.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
 AVal undefined;
 
-Environment::Environment(Environment* parent)
+namespace FrameStack
+{
+
+// Values of a segment
+static const size_t SEGMENT_SIZE = 64 * 1024;
+
+std::vector<Segment> segments;
+size_t top = 0;
+
+AVal *push(size_t count)
+{
+    if (segments.empty()) {
+        segments.push_back({new AVal[SEGMENT_SIZE], SEGMENT_SIZE, 0});
+    }
+    while (segments[top].used + count > segments[top].size) {
+        // A frame does not span segments, the rest of the full one stays unused
+        if (top + 1 == segments.size()) {
+            const size_t size = std::max(SEGMENT_SIZE, count);
+            segments.push_back({new AVal[size], size, 0});
+        }
+        ++top;
+    }
+
+    Segment &s = segments[top];
+    AVal *frame = s.base + s.used;
+    for (size_t i = 0; i < count; ++i) {
+        new (&frame[i]) AVal();
+        frame[i]._root = AVal::Framed;
+    }
+    s.used += count;
+    return frame;
+}
+
+void pop(size_t count)
+{
+    X_ASSERT(segments[top].used >= count);
+    segments[top].used -= count;
+    while (top > 0 && segments[top].used == 0) {
+        --top;
+    }
+}
+
+void clear()
+{
+    for (Segment &s : segments) {
+        for (size_t i = 0; i < s.size; ++i) {
+            s.base[i]._root = AVal::Unrooted;
+        }
+        delete[] s.base;
+    }
+    segments.clear();
+    top = 0;
+}
+
+} // namespace FrameStack
+
+namespace NativeStack
+{
+
+static const size_t SEGMENT_SIZE = 4 * 1024 * 1024;
+// Left on every stack for builtins and the collector
+static const size_t RESERVE = 256 * 1024;
+// 1 GiB of stack, deeper recursion is an error of the script
+static const size_t MAX_SEGMENTS = 256;
+
+uintptr_t limit = 0;
+
+static std::vector<char*> segments;
+// Segments in use, they are taken in order
+static size_t used = 0;
+
+struct Switch {
+    void (*f)(void*);
+    void *arg;
+    ucontext_t caller;
+    ucontext_t callee;
+};
+
+static Switch *entering = nullptr;
+
+static void enter()
+{
+    Switch *s = entering;
+    s->f(s->arg);
+    // Nothing is left to unwind on the segment, its context is dropped
+    swapcontext(&s->callee, &s->caller);
+}
+
+void init()
+{
+    char here;
+    size_t size = 8 * 1024 * 1024;
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_STACK, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+        size = rl.rlim_cur;
+    }
+    limit = reinterpret_cast<uintptr_t>(&here) - size + std::min(RESERVE, size / 2);
+}
+
+bool run(void (*f)(void*), void *arg)
+{
+    if (used == segments.size()) {
+        if (used == MAX_SEGMENTS) {
+            return false;
+        }
+        void *p = mmap(nullptr, SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED) {
+            return false;
+        }
+        // A frame larger than the reserve faults on the guard page
+        mprotect(p, sysconf(_SC_PAGESIZE), PROT_NONE);
+        segments.push_back(static_cast<char*>(p));
+    }
+    char *base = segments[used++];
+
+    Switch s;
+    s.f = f;
+    s.arg = arg;
+    getcontext(&s.callee);
+    s.callee.uc_stack.ss_sp = base;
+    s.callee.uc_stack.ss_size = SEGMENT_SIZE;
+    s.callee.uc_link = nullptr;
+    makecontext(&s.callee, enter, 0);
+
+    const uintptr_t saved = limit;
+    limit = reinterpret_cast<uintptr_t>(base) + RESERVE;
+    entering = &s;
+    swapcontext(&s.caller, &s.callee);
+    limit = saved;
+    --used;
+    return true;
+}
+
+void release()
+{
+    // exit() of a script may be called on a segment
+    if (used) {
+        return;
+    }
+    for (char *s : segments) {
+        munmap(s, SEGMENT_SIZE);
+    }
+    segments.clear();
+}
+
+} // namespace NativeStack
+
+Environment::Environment(Environment* parent, const SlotMap *slotNames)
     : parent(parent)
+    , slotNames(slotNames)
 {
+    if (slotNames) {
+        slots = FrameStack::push(slotNames->size());
+    }
 }
 
 Environment::~Environment()
 {
+    if (slotNames) {
+        FrameStack::pop(slotNames->size());
+    }
 }
 
 AVal &Environment::get(const std::string& key)
 {
-    if(keys.find(key) != keys.end())
-      return keys[key];
+    if (slotNames) {
+        auto slot = slotNames->find(key);
+        if (slot != slotNames->end())
+          return slots[slot->second];
+    }
+    auto it = keys.find(key);
+    if(it != keys.end())
+      return it->second;
     if(parent)
       return parent->get(key);
     return undefined;
@@ -24,6 +192,8 @@ AVal &Environment::get(const std::string& key)
 
 bool Environment::has(const std::string& key) const
 {
+    if(slotNames && slotNames->find(key) != slotNames->end())
+      return true;
     if(keys.find(key) != keys.end())
       return true;
     if(parent)
@@ -33,5 +203,12 @@ bool Environment::has(const std::string& key) const
 
 void Environment::set(const std::string& key, const AVal &val)
 {
+    if (slotNames) {
+        auto slot = slotNames->find(key);
+        if (slot != slotNames->end()) {
+            slots[slot->second] = val;
+            return;
+        }
+    }
     keys[key] = val;
 }
@@ -6,6 +6,8 @@ class Environment;
 #include "aval.h"
 
 #include <string>
+#include <cstdint>
+#include <vector>
 #include <unordered_map>
 
 class Environment
@@ -19,7 +21,9 @@ public:
         FlowInterrupted = ReturnCalled | BreakCalled | ContinueCalled
     };
 
-    explicit Environment(Environment *parent = nullptr);
+    typedef std::unordered_map<std::string, int> SlotMap;
+
+    explicit Environment(Environment *parent = nullptr, const SlotMap *slotNames = nullptr);
     ~Environment();
 
     AVal &get(const std::string &key);
@@ -27,9 +31,69 @@ public:
     void set(const std::string &key, const AVal &val);
 
     Environment *parent;
+    const SlotMap *slotNames;
+    // Taken from the frame stack, environments are destroyed in reverse order of creation
+    AVal *slots = nullptr;
     std::unordered_map<std::string, AVal> keys;
 
     AVal returnValue;
     State state = Normal;
+
+    // Set by a return which leaves its call to the caller of the frame
+    Ast::Function *tailFunction = nullptr;
+    std::vector<AVal> tailArguments;
 };
 
+// Slots of running functions and registers of the VM. Frames are taken and
+// released in LIFO order from segments which never move, so references to
+// slots stay valid. Values in frames are not on the root stack, the collector
+// scans the used part of the segments instead.
+namespace FrameStack
+{
+    struct Segment {
+        AVal *base;
+        size_t size;
+        size_t used;
+    };
+
+    extern std::vector<Segment> segments;
+    // Segment frames are currently taken from
+    extern size_t top;
+
+    // Returns count undefined values
+    AVal *push(size_t count);
+    // Releases the last frame taken
+    void pop(size_t count);
+    // Frees all segments, frames still taken are dropped
+    void clear();
+
+    template<typename F>
+    void forEach(F f)
+    {
+        for (size_t s = 0; s < segments.size() && s <= top; ++s) {
+            for (size_t i = 0; i < segments[s].used; ++i) {
+                f(segments[s].base[i]);
+            }
+        }
+    }
+}
+
+// Script calls recurse on the native stack. When it runs low, calls continue
+// on segments mapped for the purpose, so recursion is limited by memory only.
+namespace NativeStack
+{
+    // Stack addresses below the limit belong to the reserve of the running stack
+    extern uintptr_t limit;
+
+    inline bool low()
+    {
+        return reinterpret_cast<uintptr_t>(__builtin_frame_address(0)) < limit;
+    }
+
+    // Measures the stack of the calling thread
+    void init();
+    // Runs f(arg) on a new segment, false when no more segments can be mapped
+    bool run(void (*f)(void*), void *arg);
+    // Unmaps the segments, unless one is running
+    void release();
+}
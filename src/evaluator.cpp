@@ -4,11 +4,15 @@
 #include "environment.h"
 #include "memorypool.h"
 #include "bootstrap.h"
+#include "bytecode.h"
+#include "vm.h"
+#include "kernels.h"
 
 #include <memory>
 #include <cstring>
 #include <iostream>
 #include <algorithm>
+#include <functional>
 #include <unordered_set>
 
 std::vector<Environment*> envirs;
@@ -16,12 +20,30 @@ Environment *currentEnvironment = nullptr;
 
 typedef std::unordered_set<std::string> Scope;
 Scope globalFunctions;
-std::vector<Scope> scopes;
+// Names known in a running function. Its precomputed scope is shared by all
+// calls, names created by the call are kept apart.
+struct CallScope {
+    const Scope *names;
+    std::unique_ptr<Scope> created;
+};
+std::vector<CallScope> scopes;
 std::unordered_map<Ast::Function*, Scope> functionScopes;
+// Names bound in function frames, lookups of them may find a local of a caller
+Scope frameNames;
+// Call site caches of other versions are stale
+unsigned long callCacheVersion = 1;
+
+static void addFrameName(const std::string &name)
+{
+    if (frameNames.insert(name).second) {
+        ++callCacheVersion;
+    }
+}
 
 static bool symbolLookup(const std::string &s)
 {
-    if (scopes.back().find(s) != scopes.back().end()) {
+    const CallScope &scope = scopes.back();
+    if (scope.names->count(s) || (scope.created && scope.created->count(s))) {
         return true;
     }
     if (globalFunctions.find(s) != globalFunctions.end()) {
@@ -30,37 +52,162 @@ static bool symbolLookup(const std::string &s)
     return false;
 }
 
+template<typename F>
+static void forEachChild(Ast::Node *p, F f)
+{
+    if (p->type() == Ast::Node::VariableListT) {
+        for (Ast::Variable *v : p->as<Ast::VariableList*>()->variables) {
+            f(v);
+        }
+        return;
+    }
+    for (Ast::Node *n : { p->n1, p->n2, p->n3, p->n4 }) {
+        if (n) {
+            f(n);
+        }
+    }
+    for (Ast::Node *n : p->exprVec1) {
+        f(n);
+    }
+    for (Ast::Node *n : p->statements) {
+        f(n);
+    }
+}
+
+// Names called as functions are always looked up by name, they usually refer to global functions
+static void collectCalledNames(Ast::Node *p, Scope &names)
+{
+    if (!p || p->type() == Ast::Node::FunctionT) {
+        return;
+    }
+    if (p->type() == Ast::Node::FunctionCallT) {
+        Ast::Node *func = p->as<Ast::FunctionCall*>()->function();
+        if (func && func->type() == Ast::Node::VariableT) {
+            names.insert(func->as<Ast::Variable*>()->name);
+        }
+    }
+    forEachChild(p, [&](Ast::Node *n) { collectCalledNames(n, names); });
+}
+
+static void resolveFunction(Ast::Function *f, const Scope &outer);
+
+// Walks the function body in evaluation order and assigns frame slots to its local variables
+static void resolveVariables(Ast::Node *p, Ast::Function *f, const Scope &outer, const Scope &called, Scope &seen)
+{
+    if (!p) {
+        return;
+    }
+
+    switch (p->type()) {
+    case Ast::Node::VariableT: {
+        Ast::Variable *v = p->as<Ast::Variable*>();
+        seen.insert(v->name);
+        auto slot = f->localSlots.find(v->name);
+        if (slot != f->localSlots.end()) {
+            v->slot = slot->second;
+        } else if (outer.count(v->name) || globalFunctions.count(v->name) || called.count(v->name)) {
+            v->slot = -1;
+        } else {
+            v->slot = f->localSlots.size();
+            f->localSlots[v->name] = v->slot;
+        }
+        return;
+    }
+
+    case Ast::Node::FunctionT: {
+        Ast::Function *lambda = p->as<Ast::Function*>();
+        if (lambda->isLambda() && !lambda->resolved) {
+            // Lambda sees variables of this function that were created before its definition
+            Scope scope = outer;
+            scope.insert(seen.begin(), seen.end());
+            resolveFunction(lambda, scope);
+        }
+        return;
+    }
+
+    case Ast::Node::AssignmentT:
+        resolveVariables(p->n2, f, outer, called, seen);
+        resolveVariables(p->n1, f, outer, called, seen);
+        return;
+
+    case Ast::Node::ArraySubscriptT:
+        resolveVariables(p->n2, f, outer, called, seen);
+        resolveVariables(p->n1, f, outer, called, seen);
+        return;
+
+    case Ast::Node::FunctionCallT:
+        resolveVariables(p->n1, f, outer, called, seen);
+        resolveVariables(p->n3, f, outer, called, seen);
+        resolveVariables(p->n2, f, outer, called, seen);
+        return;
+
+    default:
+        forEachChild(p, [&](Ast::Node *n) { resolveVariables(n, f, outer, called, seen); });
+    }
+}
+
+static void resolveFunction(Ast::Function *f, const Scope &outer)
+{
+    f->resolved = true;
+    f->localSlots.clear();
+
+    Scope seen;
+    for (Ast::Variable *v : f->parameters()->variables) {
+        auto slot = f->localSlots.find(v->name);
+        if (slot == f->localSlots.end()) {
+            v->slot = f->localSlots.size();
+            f->localSlots[v->name] = v->slot;
+        } else {
+            v->slot = slot->second;
+        }
+        seen.insert(v->name);
+    }
+
+    Scope called;
+    collectCalledNames(f->statements(), called);
+    resolveVariables(f->statements(), f, outer, called, seen);
+
+    Scope scope = outer;
+    for (auto &l : f->localSlots) {
+        scope.insert(l.first);
+        addFrameName(l.first);
+    }
+    functionScopes[f] = scope;
+}
+
 static void createFunctionScope(Ast::Function *f)
 {
-     Scope scope = scopes.back();
-     for (Ast::Variable *v : f->parameters()->variables) {
-        scope.insert(v->name);
-     }
-     functionScopes[f] = scope;
+    if (!f->resolved) {
+        Scope outer = *scopes.back().names;
+        if (scopes.back().created) {
+            outer.insert(scopes.back().created->begin(), scopes.back().created->end());
+        }
+        resolveFunction(f, outer);
+    }
 }
 
 static void createGlobalScope(Environment *e)
 {
-    Scope scope;
+    static const Scope noNames;
+    std::unique_ptr<Scope> scope(new Scope);
     for (auto i : e->keys) {
         if (i.second.isFunction() || i.second.isBuiltinFunction()) {
             globalFunctions.insert(i.first);
         } else {
-            scope.insert(i.first);
+            scope->insert(i.first);
         }
     }
-    scopes.push_back(scope);
+    scopes.push_back({&noNames, std::move(scope)});
 }
 
 // Operators
-static AVal binaryOp(Ast::BinaryOperator::Op op, const AVal &a, const AVal &b);
+using Evaluator::binaryOp;
 
 static AVal binaryOp_impl(Ast::BinaryOperator::Op op, AArray *a, AArray *b)
 {
     switch (op) {
     case Ast::BinaryOperator::Plus:
-        // return (sa + sb).c_str();
-        return Evaluator::INVOKE_INTERNAL("merge", currentEnvironment, { a, b });
+        return Evaluator::merge(a, b);
     case Ast::BinaryOperator::Minus:
     case Ast::BinaryOperator::Times:
     case Ast::BinaryOperator::Div:
@@ -72,11 +219,34 @@ static AVal binaryOp_impl(Ast::BinaryOperator::Op op, AArray *a, AArray *b)
         // Invalid operator for array
         return AVal();
     case Ast::BinaryOperator::Equal:
-        if (a->count != b->count) {
+        if (a->count != b->count || !a->keys != !b->keys) {
             return false;
         }
+        if (a->keys) {
+            // Maps are equal when they hold the same keys in the same order
+            for (size_t i = 0; i < a->count; ++i) {
+                const AKeys::Key &ka = a->keys->keys[i];
+                const AKeys::Key &kb = b->keys->keys[i];
+                if (ka.hash != kb.hash || !ka.string != !kb.string
+                        || (ka.string ? strcmp(ka.string, kb.string) != 0 : ka.number != kb.number)) {
+                    return false;
+                }
+            }
+        }
+        if (a->kind == b->kind) {
+            switch (a->kind) {
+            case AArray::INT32:
+                return memcmp(a->ints, b->ints, a->count * sizeof(int)) == 0;
+            case AArray::CHAR:
+                return memcmp(a->chars, b->chars, a->count) == 0;
+            case AArray::DOUBLE:
+                return Kernels::equal(a->doubles, b->doubles, a->count);
+            default:
+                break;
+            }
+        }
         for (size_t i = 0; i < a->count; ++i) {
-            if (!binaryOp(Ast::BinaryOperator::Equal, a->array[i], b->array[i]).toBool()) {
+            if (!binaryOp(Ast::BinaryOperator::Equal, a->get(i), b->get(i)).toBool()) {
                 return false;
             }
         }
@@ -96,12 +266,13 @@ static AVal binaryOp_impl(Ast::BinaryOperator::Op op, AArray *a, AArray *b)
 
 static AVal binaryOp_impl(Ast::BinaryOperator::Op op, const char *a, const char *b)
 {
-    std::string sa = a;
-    std::string sb = b;
-
     switch (op) {
-    case Ast::BinaryOperator::Plus:
-        return (sa + sb).c_str();
+    case Ast::BinaryOperator::Plus: {
+        std::string s;
+        s.reserve(strlen(a) + strlen(b));
+        s.append(a).append(b);
+        return s.c_str();
+    }
     case Ast::BinaryOperator::Minus:
     case Ast::BinaryOperator::Times:
     case Ast::BinaryOperator::Div:
@@ -109,21 +280,21 @@ static AVal binaryOp_impl(Ast::BinaryOperator::Op op, const char *a, const char
         // Invalid operator for string
         return AVal();
     case Ast::BinaryOperator::Equal:
-        return sa == sb;
+        return strcmp(a, b) == 0;
     case Ast::BinaryOperator::NotEqual:
-        return sa != sb;
+        return strcmp(a, b) != 0;
     case Ast::BinaryOperator::LessThan:
-        return sa < sb;
+        return strcmp(a, b) < 0;
     case Ast::BinaryOperator::GreaterThan:
-        return sa > sb;
+        return strcmp(a, b) > 0;
     case Ast::BinaryOperator::LessThanEqual:
-        return sa <= sb;
+        return strcmp(a, b) <= 0;
     case Ast::BinaryOperator::GreaterThanEqual:
-        return sa >= sb;
+        return strcmp(a, b) >= 0;
     case Ast::BinaryOperator::And:
-        return !sa.empty() && !sb.empty();
+        return *a && *b;
     case Ast::BinaryOperator::Or:
-        return !sa.empty() || !sb.empty();
+        return *a || *b;
     default:
         X_UNREACHABLE();
     }
@@ -168,7 +339,7 @@ static AVal binaryOp_impl(Ast::BinaryOperator::Op op, T a, T b)
     return AVal();
 }
 
-static AVal binaryOp(Ast::BinaryOperator::Op op, const AVal &a, const AVal &b)
+AVal Evaluator::binaryOp(Ast::BinaryOperator::Op op, const AVal &a, const AVal &b)
 {
     CHECKTHROWN(a)
     CHECKTHROWN(b)
@@ -211,6 +382,94 @@ static AVal binaryOp(Ast::BinaryOperator::Op op, const AVal &a, const AVal &b)
     return AVal();
 }
 
+// Value a variable reference points to, other values are taken as they are
+static inline const AVal &target(const AVal &v)
+{
+    return v._type == AVal::REFERENCE ? v.deref() : v;
+}
+
+// Both operands hold values of type t
+static inline bool bothOfType(const AVal &a, const AVal &b, AVal::Type t)
+{
+    return !a._thrown && !b._thrown && target(a)._type == t && target(b)._type == t;
+}
+
+AVal Evaluator::binaryOp(Ast::BinaryOperator::Op op, Ast::Specialization &spec, const AVal &a, const AVal &b)
+{
+    if (spec == Ast::Specialization::None) {
+        spec = Ast::Specialization::Generic;
+        if (op != Ast::BinaryOperator::EqualType && op != Ast::BinaryOperator::NotEqualType) {
+            if (bothOfType(a, b, AVal::INT)) {
+                spec = Ast::Specialization::Int;
+            } else if (bothOfType(a, b, AVal::DOUBLE)) {
+                spec = Ast::Specialization::Double;
+            } else if (bothOfType(a, b, AVal::STRING)) {
+                spec = Ast::Specialization::String;
+            }
+        }
+    }
+
+    switch (spec) {
+    case Ast::Specialization::Int:
+        if (bothOfType(a, b, AVal::INT)) {
+            return binaryOp_impl(op, target(a).intValue, target(b).intValue);
+        }
+        break;
+    case Ast::Specialization::Double:
+        if (bothOfType(a, b, AVal::DOUBLE)) {
+            return binaryOp_impl(op, target(a).doubleValue, target(b).doubleValue);
+        }
+        break;
+    case Ast::Specialization::String:
+        if (bothOfType(a, b, AVal::STRING)) {
+            return binaryOp_impl(op, target(a).stringValue->chars(), target(b).stringValue->chars());
+        }
+        break;
+    default:
+        return binaryOp(op, a, b);
+    }
+
+    spec = Ast::Specialization::Generic;
+    return binaryOp(op, a, b);
+}
+
+AVal Evaluator::subscript(Ast::Specialization &spec, const AVal &arr, const AVal &index)
+{
+    const AVal &a = target(arr);
+    const AVal &i = target(index);
+    const bool plain = a._type == AVal::ARRAY && !arr._thrown && !index._thrown;
+
+    if (spec == Ast::Specialization::None) {
+        spec = Ast::Specialization::Generic;
+        if (plain && i._type == AVal::INT && !a.arrayValue->keys) {
+            spec = Ast::Specialization::Int;
+        } else if (plain && i._type == AVal::STRING && a.arrayValue->keys) {
+            spec = Ast::Specialization::String;
+        }
+    }
+
+    switch (spec) {
+    case Ast::Specialization::Int:
+        if (plain && i._type == AVal::INT && !a.arrayValue->keys) {
+            if (i.intValue < 0 || i.intValue >= a.arrayValue->count) {
+                THROW2("Index %d out of bounds", i.intValue);
+            }
+            return a.arrayValue->get(i.intValue);
+        }
+        break;
+    case Ast::Specialization::String:
+        if (plain && i._type == AVal::STRING && a.arrayValue->keys) {
+            const long pos = a.arrayValue->find(i);
+            return pos < 0 ? AVal() : a.arrayValue->get(pos);
+        }
+        break;
+    default:
+        return subscript(arr, index.dereference(), false);
+    }
+
+    spec = Ast::Specialization::Generic;
+    return subscript(arr, index.dereference(), false);
+}
 
 
 namespace Evaluator
@@ -221,30 +480,130 @@ namespace Evaluator
 
 
 
-static AVal doUserdefFunction(Ast::Function *func, const std::vector<Ast::Expression*> &arguments, Environment *envir)
+// Function called by a return after its frame is gone
+struct TailCall {
+    Ast::Function *function = nullptr;
+    std::vector<AVal> arguments;
+};
+
+// Runs one call of a user defined function, bind(i, v, r) stores the argument
+// for parameter i in r. A tail call the function returns with is moved to next.
+template<typename Bind>
+static AVal runFrame(Ast::Function *func, Environment *envir, Bind bind, TailCall &next)
 {
-    // Create environment for this function
-    bool pushedScope = false;
-    using Environment_ptr = std::unique_ptr<Environment, std::function<void(Environment*)>>;
-    Environment_ptr funcEnvironment(new Environment(envir), [&](Environment *e) {
-        envirs.erase(std::remove(envirs.begin(), envirs.end(), e), envirs.end());
-        delete e;
-        if (pushedScope) {
-            scopes.pop_back();
+    Environment funcEnvironment(envir, &func->localSlots);
+    // Calls return in reverse order, so the frame is always the last one
+    struct Frame {
+        explicit Frame(Environment *e) {
+            envirs.push_back(e);
         }
-    });
-    envirs.push_back(funcEnvironment.get());
+        ~Frame() {
+            envirs.pop_back();
+            if (pushedScope) {
+                scopes.pop_back();
+            }
+        }
+        bool pushedScope = false;
+    } frame(&funcEnvironment);
 
     for (int i = 0; i < func->parameters()->variables.size(); i++) {
         Ast::Variable *v = func->parameters()->variables[i];
-        Ast::Expression *e = arguments.size() > i ? arguments[i] : nullptr;
         AVal r;
+        CHECKTHROWN(bind(i, v, r));
+        funcEnvironment.slots[v->slot] = r;
+    }
+
+    scopes.push_back({&functionScopes.at(func), nullptr});
+    frame.pushedScope = true;
+
+    // Execute statement list of function
+    if (mode() == BytecodeMode) {
+        if (!func->chunk) {
+            func->chunk = Bytecode::compile(func);
+        }
+        CHECKTHROWN(VM::run(func->chunk, &funcEnvironment));
+    } else {
+        CHECKTHROWN(ex(func->statements(), &funcEnvironment));
+    }
+
+    next.function = funcEnvironment.tailFunction;
+    next.arguments.swap(funcEnvironment.tailArguments);
+    return funcEnvironment.returnValue;
+}
+
+static AVal bindValue(const std::vector<AVal> &arguments, int i, Ast::Variable *v, AVal &r)
+{
+    if (arguments.size() <= i) {
+        return AVal();
+    }
+    const AVal &a = arguments[i];
+    if (!v->ref) {
+        r = a.dereference().copy();
+    } else if (a.isReference() && a.isConst() && !v->isconst) {
+        THROW2("Argument %d violates const-correctness!", i);
+    } else {
+        r = a;
+        r.markConst(v->isconst);
+    }
+    return AVal();
+}
+
+template<typename F>
+static bool runOnNewStack(F &f)
+{
+    return NativeStack::run([](void *p) { (*static_cast<F*>(p))(); }, &f);
+}
+
+template<typename Bind>
+static AVal runUserdefFunction(Ast::Function *func, Environment *envir, Bind bind)
+{
+    if (NativeStack::low()) {
+        AVal r;
+        auto run = [&]() { r = runUserdefFunction(func, envir, bind); };
+        if (!runOnNewStack(run)) {
+            THROW("Maximum call stack size exceeded");
+        }
+        return r;
+    }
+
+    TailCall next;
+    AVal r = runFrame(func, envir, bind, next);
+    // Tail calls run in a loop, so they do not grow the stack
+    while (next.function && !r.isThrown()) {
+        TailCall call;
+        std::swap(call, next);
+        r = runFrame(call.function, envir, [&](int i, Ast::Variable *v, AVal &a) -> AVal {
+            return bindValue(call.arguments, i, v, a);
+        }, next);
+    }
+    return r;
+}
+
+// Variables and elements of them can be referred to, values of other expressions
+// are temporaries. Literal AVals are references already when they refer to something.
+static bool isLValue(Ast::Node *p)
+{
+    while (p->type() == Ast::Node::ArraySubscriptT) {
+        p = p->as<Ast::ArraySubscript*>()->source();
+    }
+    return p->type() == Ast::Node::VariableT || p->type() == Ast::Node::AValLiteralT;
+}
+
+static AVal doUserdefFunction(Ast::Function *func, const std::vector<Ast::Expression*> &arguments, Environment *envir)
+{
+    return runUserdefFunction(func, envir, [&](int i, Ast::Variable *v, AVal &r) -> AVal {
+        Ast::Expression *e = arguments.size() > i ? arguments[i] : nullptr;
         if (e && v->ref) {
-            setExFlag(ReturnLValue);
+            // Temporaries are passed as values, only const references accept them
+            if (isLValue(e)) {
+                setExFlag(ReturnLValue);
+            } else {
+                clearExFlag(ReturnLValue);
+            }
             r = ex(e, envir);
             clearExFlag(ReturnLValue);
             CHECKTHROWN(r);
-            if (r.isReference() && r.toReference()->isReference()) {
+            if (r.isReference() && r._refKind == AVal::VALUE_REF && r.toReference()->isReference()) {
                 // It already was reference
                 r = r.dereference();
                 if (r.isConst() && !v->isconst) {
@@ -267,19 +626,30 @@ static AVal doUserdefFunction(Ast::Function *func, const std::vector<Ast::Expres
             CHECKTHROWN(r);
             r = r.dereference().copy();
         }
-        funcEnvironment->set(v->name, r);
-    }
+        return AVal();
+    });
+}
 
-    scopes.push_back(functionScopes.at(func));
-    pushedScope = true;
+// Arguments are values already, callbacks of native builtins are called this way
+static AVal doUserdefFunction(Ast::Function *func, const std::vector<AVal> &arguments, Environment *envir)
+{
+    return runUserdefFunction(func, envir, [&](int i, Ast::Variable *v, AVal &r) -> AVal {
+        return bindValue(arguments, i, v, r);
+    });
+}
 
-    // Execute statement list of function
-    CHECKTHROWN(ex(func->statements(), funcEnvironment.get()));
+int exFlags = NoFlag;
+Mode exMode = BytecodeMode;
 
-    return funcEnvironment->returnValue;
+void setMode(Mode mode)
+{
+    exMode = mode;
 }
 
-int exFlags = NoFlag;
+Mode mode()
+{
+    return exMode;
+}
 
 void setExFlag(ExFlag flag)
 {
@@ -297,37 +667,256 @@ void clearExFlag(ExFlag flag)
 }
 
 
-AVal ex(Ast::Node *p, Environment* envir)
+AVal &variable(Ast::Variable *v, Environment *envir)
 {
-    if (!p) {
-        return AVal();
+    if (v->slot >= 0) {
+        return envir->slots[v->slot];
+    }
+    if (v->global && !envir->parent) {
+        return *v->global;
     }
+    if (!symbolLookup(v->name)) {
+        envir->set(v->name, AVal());
+        std::unique_ptr<Scope> &created = scopes.back().created;
+        if (!created) {
+            created.reset(new Scope);
+        }
+        created->insert(v->name);
+        if (envir->parent) {
+            addFrameName(v->name);
+        }
+    }
+    AVal &var = envir->get(v->name);
+    if (!envir->parent) {
+        // Global variables are never removed, so the lookup can be cached in the node
+        v->global = &var;
+    }
+    return var;
+}
 
-    currentEnvironment = envir;
+AVal assignToReference(AVal *ref, const AVal &value)
+{
+    if (ref->isConst()) {
+        THROW("Cannot write to const!");
+    }
+    if (value._refKind != AVal::VALUE_REF) {
+        return assignToReference(ref, value.dereference());
+    }
+    if (ref->isReference() && ref->_refKind == AVal::VALUE_REF) {
+        ref->toReference()->assign(value.deref());
+    } else {
+        ref->assign(value.deref());
+    }
+    return AVal();
+}
 
-    auto assignToExpression = [](Ast::Expression *v, const AVal &value, Environment *envir) {
-        setExFlag(ReturnLValue);
-        AVal dest = ex(v, envir);
-        clearExFlag(ReturnLValue);
-        if (!dest.isReference()) {
-            THROW("Cannot write to rvalue!");
+AVal assignTo(Ast::Expression *v, const AVal &value, Environment *envir)
+{
+    if (v->type() == Ast::Node::ArraySubscriptT && isLValue(v)) {
+        // Elements are stored directly, so unboxed arrays keep their storage when they can
+        Ast::ArraySubscript *s = v->as<Ast::ArraySubscript*>();
+        AVal ind = ex(s->expression(), envir).dereference();
+        CHECKTHROWN(ind)
+        AVal arr = ex(s->source(), envir);
+        CHECKTHROWN(arr)
+        if (arr.isArray() && arr.toArray()->keys) {
+            AArray *a = arr.toArray();
+            if (!AKeys::isKey(ind)) {
+                THROW("Map key must be of type int or string.");
+            }
+            const long pos = a->find(ind);
+            if (pos < 0) {
+                a->insert(ind, value);
+            } else {
+                MemoryPool::makeWritable(a);
+                a->set(pos, value);
+            }
+            return AVal();
         }
-        if (dest._charref) {
-            // String subscript
-            dest.assign(value);
+        if (arr.isArray()) {
+            AArray *a = arr.toArray();
+            const int index = ind.toInt();
+            if (index < 0 || index >= a->count) {
+                THROW2("Index %d out of bounds", index);
+            }
+            MemoryPool::makeWritable(a);
+            a->set(index, value);
             return AVal();
         }
-        AVal *ref = dest.toReference();
-        if (ref->isConst()) {
-            THROW("Cannot write to const!");
+        AVal dest = subscript(arr.dereference(), ind, true);
+        CHECKTHROWN(dest)
+        dest.assign(value);
+        return AVal();
+    }
+
+    setExFlag(ReturnLValue);
+    AVal dest = ex(v, envir);
+    clearExFlag(ReturnLValue);
+    if (!dest.isReference()) {
+        THROW("Cannot write to rvalue!");
+    }
+    if (dest._refKind != AVal::VALUE_REF) {
+        // String or array subscript
+        dest.assign(value);
+        return AVal();
+    }
+    return assignToReference(dest.toReference(), value);
+}
+
+AVal subscript(const AVal &arr, const AVal &index, bool lvalue)
+{
+    if (!arr.isArray() || !arr.toArray()->keys) {
+        return subscript(arr, index.toInt(), lvalue);
+    }
+
+    AArray *a = arr.toArray();
+    if (!AKeys::isKey(index)) {
+        THROW("Map key must be of type int or string.");
+    }
+    long pos = a->find(index);
+    if (!lvalue) {
+        return pos < 0 ? AVal() : a->get(pos);
+    }
+    if (pos < 0) {
+        a->insert(index, AVal());
+        pos = a->count - 1;
+    }
+    return AVal::createElementReference(a, pos);
+}
+
+AVal subscript(const AVal &arr, int index, bool lvalue)
+{
+    if (arr.isArray()) {
+        AArray *a = arr.toArray();
+        if (index < 0 || index >= a->count) {
+            THROW2("Index %d out of bounds", index);
         }
-        if (ref->isReference()) {
-            ref->toReference()->assign(value.dereference());
-        } else {
-            ref->assign(value.dereference());
+        if (!lvalue) {
+            return a->get(index);
+        }
+        return AVal::createElementReference(a, index);
+    } else if (arr.isString()) {
+        AString *s = arr.dereference().stringValue;
+        size_t count = strlen(s->chars());
+        if (index < 0 || index >= count) {
+            THROW2("Index %d out of bounds", index);
+        }
+        if (lvalue) {
+            return AVal::createCharReference(s, index);
         }
+        return s->chars()[index];
+    } else {
+        THROW2("Variable %s is not array", arr.dereference().typeStr());
+    }
+}
+
+AVal callee(Ast::FunctionCall *v, Environment *envir)
+{
+    if (v->cacheVersion == callCacheVersion) {
+        return *v->cachedBinding;
+    }
+
+    Ast::Node *f = v->function();
+    if (f->type() != Ast::Node::VariableT || static_cast<Ast::Variable*>(f)->slot >= 0) {
+        return ex(f, envir);
+    }
+    Ast::Variable *var = static_cast<Ast::Variable*>(f);
+    AVal &binding = variable(var, envir);
+    // Only global bindings no frame can shadow are cached, they are never removed
+    if (!frameNames.count(var->name)) {
+        auto global = envirs[0]->keys.find(var->name);
+        if (global != envirs[0]->keys.end() && &global->second == &binding) {
+            v->cachedBinding = &binding;
+            v->cacheVersion = callCacheVersion;
+        }
+    }
+    return binding;
+}
+
+AVal call(const AVal &func, Ast::FunctionCall *v, Environment *envir)
+{
+    const std::vector<Ast::Expression*> &args = v->callArguments();
+
+    if (func.isFunction()) {
+        return doUserdefFunction(func.toFunction(), args, envir);
+    } else if (func.isBuiltinFunction()) {
+        BuiltinCall call = func.toBuiltinFunction();
+        if (call) {
+            return (*call)(args, envir);
+        }
+    }
+
+    THROW2("Call of argument '%s' which is not function", func.toString());
+}
+
+AVal call(const AVal &func, const std::vector<AVal> &args, Environment *envir)
+{
+    if (func.isFunction()) {
+        return doUserdefFunction(func.toFunction(), args, envir);
+    } else if (func.isBuiltinFunction()) {
+        BuiltinCall call = func.toBuiltinFunction();
+        if (call) {
+            // Builtins evaluate their arguments themselves
+            std::vector<Ast::AValLiteral> literals;
+            literals.reserve(args.size());
+            std::vector<Ast::Expression*> exprs;
+            for (const AVal &a : args) {
+                literals.emplace_back(&a);
+                exprs.push_back(&literals.back());
+            }
+            return (*call)(exprs, envir);
+        }
+    }
+
+    THROW2("Call of argument '%s' which is not function", func.toString());
+}
+
+// The frame may be dropped before func runs when nothing can see it any more:
+// func has no reference parameters and binds every name the frame binds
+static bool replacesFrame(Ast::Function *func, Ast::FunctionCall *v, Environment *envir)
+{
+    if (!envir->slotNames || !envir->keys.empty()) {
+        return false;
+    }
+    // The call node is in one function, so only the callee can change
+    if (v->tailCallee != func) {
+        v->tailCallee = func;
+        v->replacesFrame = true;
+        for (Ast::Variable *p : func->parameters()->variables) {
+            if (p->ref) {
+                v->replacesFrame = false;
+            }
+        }
+        for (auto &slot : *envir->slotNames) {
+            if (!func->localSlots.count(slot.first)) {
+                v->replacesFrame = false;
+            }
+        }
+    }
+    return v->replacesFrame;
+}
+
+AVal tailCall(const AVal &func, Ast::FunctionCall *v, Environment *envir)
+{
+    if (!func.isFunction() || !replacesFrame(func.toFunction(), v, envir)) {
+        return call(func, v, envir);
+    }
+    for (Ast::Expression *e : v->callArguments()) {
+        AVal r = ex(e, envir);
+        CHECKTHROWN(r);
+        envir->tailArguments.push_back(r.dereference().copy());
+    }
+    envir->tailFunction = func.toFunction();
+    return AVal();
+}
+
+AVal ex(Ast::Node *p, Environment* envir)
+{
+    if (!p) {
         return AVal();
-    };
+    }
+
+    currentEnvironment = envir;
 
     switch (p->type()) {
 
@@ -350,12 +939,8 @@ AVal ex(Ast::Node *p, Environment* envir)
         return p->as<Ast::ConstantLiteral*>()->value();
         
     case Ast::Node::VariableT: {
-        Ast::Variable *v = p->as<Ast::Variable*>();
-        if (!symbolLookup(v->name)) {
-            envir->set(v->name, AVal());
-            scopes.back().insert(v->name);
-        }
-        return testExFlag(ReturnLValue) ? &envir->get(v->name) : envir->get(v->name);
+        AVal &var = variable(p->as<Ast::Variable*>(), envir);
+        return testExFlag(ReturnLValue) ? &var : var;
     }
 
     case Ast::Node::AValLiteralT:
@@ -363,36 +948,26 @@ AVal ex(Ast::Node *p, Environment* envir)
 
     case Ast::Node::ArraySubscriptT: {
         Ast::ArraySubscript *v = p->as<Ast::ArraySubscript*>();
-        AVal ind = ex(v->expression(), envir);
-        CHECKTHROWN(ind)
-        const int index = ind.toInt();
-        AVal arr = ex(v->source(), envir);
-        if (testExFlag(ReturnLValue)) {
-            arr = arr.dereference();
+        if (testExFlag(ReturnLValue) && !isLValue(v->source())) {
+            // Elements of temporaries are values, the caller reports they are not references
+            clearExFlag(ReturnLValue);
         }
-        if (arr.isArray()) {
-            AArray *a = arr.toArray();
-            if (index < 0 || index >= a->count) {
-                THROW2("Index %d out of bounds", index);
-            }
-            return testExFlag(ReturnLValue) ? &a->array[index] : a->array[index];
-        } else if (arr.isString()) {
-            AString *s = arr.dereference().stringValue;
-            size_t count = strlen(s->string);
-            if (index < 0 || index >= count) {
-                THROW2("Index %d out of bounds", index);
-            }
-            return testExFlag(ReturnLValue) ? AVal::createCharReference(&s->string[index]) : s->string[index];
-        } else {
-            THROW2("Variable %s is not array", arr.dereference().typeStr());
+        if (!testExFlag(ReturnLValue)) {
+            AVal ind = ex(v->expression(), envir);
+            CHECKTHROWN(ind)
+            return subscript(v->specialization, ex(v->source(), envir), ind);
         }
+        AVal ind = ex(v->expression(), envir).dereference();
+        CHECKTHROWN(ind)
+        AVal arr = ex(v->source(), envir).dereference();
+        return subscript(arr, ind, true);
     }
 
     case Ast::Node::AssignmentT: {
         Ast::Assignment *v = p->as<Ast::Assignment*>();
         AVal r = ex(v->expression(), envir);
         CHECKTHROWN(r);
-        CHECKTHROWN(assignToExpression(v->destination(), r, envir));
+        CHECKTHROWN(assignTo(v->destination(), r, envir));
         return r;
     }
 
@@ -408,7 +983,7 @@ AVal ex(Ast::Node *p, Environment* envir)
         if(r.isThrown()){
           AVal catched = r;
           catched.markThrown(false);
-          CHECKTHROWN(assignToExpression(v->variables()->variables[0], catched, envir));
+          CHECKTHROWN(assignTo(v->variables()->variables[0], catched, envir));
 
           AVal catchP = ex(v->catchPart(), envir);
           CHECKTHROWN(catchP)
@@ -425,6 +1000,7 @@ AVal ex(Ast::Node *p, Environment* envir)
                  THROW2("Cannot register function '%s' outside global scope.", v->name.c_str());
              }
              globalFunctions.insert(v->name);
+             ++callCacheVersion;
          }
          createFunctionScope(v);
          if (!v->isLambda()) {
@@ -436,24 +1012,10 @@ AVal ex(Ast::Node *p, Environment* envir)
     case Ast::Node::FunctionCallT: {
          Ast::FunctionCall *v = p->as<Ast::FunctionCall*>();
 
-         AVal func = ex(v->function(), envir);
+         AVal func = callee(v, envir);
          CHECKTHROWN(func)
 
-         std::vector<Ast::Expression*> args = v->arguments()->expressions();
-         if (v->object()) {
-             args.insert(args.begin(), v->object());
-         }
-
-         if (func.isFunction()) {
-              return doUserdefFunction(func.toFunction(), args, envir);
-         } else if (func.isBuiltinFunction()) {
-              BuiltinCall call = func.toBuiltinFunction();
-              if (call) {
-                  return (*call)(args, envir);
-              }
-         }
-
-         THROW2("Call of argument '%s' which is not function", func.toString());
+         return call(func, v, envir);
     }
 
     case Ast::Node::UnaryOperatorT: {
@@ -462,29 +1024,32 @@ AVal ex(Ast::Node *p, Environment* envir)
         case Ast::UnaryOperator::Not:
             return !ex(v->expr(), envir).toBool();
 
-        case Ast::UnaryOperator::Minus:
-            return binaryOp(Ast::BinaryOperator::Minus, 0, ex(v->expr(), envir));
+        case Ast::UnaryOperator::Minus: {
+            AVal val = ex(v->expr(), envir);
+            // 0.0 - x is what the generic path computes for doubles
+            return binaryOp(Ast::BinaryOperator::Minus, v->specialization, val._type == AVal::DOUBLE ? AVal(0.0) : AVal(0), val);
+        }
 
         case Ast::UnaryOperator::PreIncrement: {
-            AVal val = binaryOp(Ast::BinaryOperator::Plus, ex(v->expr(), envir), 1);
-            CHECKTHROWN(assignToExpression(v->expr(), val, envir));
+            AVal val = binaryOp(Ast::BinaryOperator::Plus, v->specialization, ex(v->expr(), envir), 1);
+            CHECKTHROWN(assignTo(v->expr(), val, envir));
             return val;
         }
         case Ast::UnaryOperator::PreDecrement: {
-            AVal val = binaryOp(Ast::BinaryOperator::Minus, ex(v->expr(), envir), 1);
-            CHECKTHROWN(assignToExpression(v->expr(), val, envir));
+            AVal val = binaryOp(Ast::BinaryOperator::Minus, v->specialization, ex(v->expr(), envir), 1);
+            CHECKTHROWN(assignTo(v->expr(), val, envir));
             return val;
         }
         case Ast::UnaryOperator::PostIncrement: {
             AVal val = ex(v->expr(), envir);
             CHECKTHROWN(val)
-            CHECKTHROWN(assignToExpression(v->expr(), binaryOp(Ast::BinaryOperator::Plus, val, 1), envir));
+            CHECKTHROWN(assignTo(v->expr(), binaryOp(Ast::BinaryOperator::Plus, v->specialization, val, 1), envir));
             return val;
         }
         case Ast::UnaryOperator::PostDecrement: {
             AVal val = ex(v->expr(), envir);
             CHECKTHROWN(val)
-            CHECKTHROWN(assignToExpression(v->expr(), binaryOp(Ast::BinaryOperator::Minus, val, 1), envir));
+            CHECKTHROWN(assignTo(v->expr(), binaryOp(Ast::BinaryOperator::Minus, v->specialization, val, 1), envir));
             return val;
         }
         default:
@@ -495,13 +1060,20 @@ AVal ex(Ast::Node *p, Environment* envir)
 
     case Ast::Node::BinaryOperatorT: {
         Ast::BinaryOperator *v = p->as<Ast::BinaryOperator*>();
-        return binaryOp(v->op, ex(v->left(), envir), ex(v->right(), envir));
+        return binaryOp(v->op, v->specialization, ex(v->left(), envir), ex(v->right(), envir));
     }
 
     case Ast::Node::ReturnT: {
         Ast::Return *v = p->as<Ast::Return*>();
         if (envir->parent) { // Only process return in functions
-            envir->returnValue = ex(v->expression(), envir);
+            Ast::Expression *e = v->expression();
+            if (e && e->type() == Ast::Node::FunctionCallT) {
+                Ast::FunctionCall *c = e->as<Ast::FunctionCall*>();
+                AVal func = callee(c, envir);
+                envir->returnValue = func.isThrown() ? func : tailCall(func, c, envir);
+            } else {
+                envir->returnValue = ex(e, envir);
+            }
             envir->state = Environment::ReturnCalled;
         }
         return AVal();
@@ -632,15 +1204,24 @@ void init()
     registerBuiltins(global);
     createGlobalScope(global);
     envirs.push_back(global);
+    NativeStack::init();
     Parser::parseString(RSPHP_BOOTSTRAP);
 }
 
 void exit()
 {
-    for (Environment *e : envirs) {
-        delete e;
+    ++callCacheVersion;
+    // Frames of running functions live on the stack, exit() may be called from one
+    for (size_t i = 1; i < envirs.size(); ++i) {
+        envirs[i]->keys.clear();
+        envirs[i]->returnValue = AVal();
+    }
+    if (!envirs.empty()) {
+        delete envirs.front();
     }
     envirs.clear();
+    FrameStack::clear();
+    NativeStack::release();
 
     Ast::cleanup();
     MemoryPool::cleanup();
@@ -652,16 +1233,20 @@ void eval(Ast::Node *p)
     Environment* global = envirs[0];
 
     //execute Ast
-    AVal ret = ex(p, global);
+    AVal ret;
+    if (mode() == BytecodeMode) {
+        std::unique_ptr<Bytecode::Chunk> chunk(Bytecode::compile(p));
+        ret = VM::run(chunk.get(), global);
+    } else {
+        ret = ex(p, global);
+    }
 
     if(ret.isThrown()){
       defaultExceptionHandler(global, ret);
     }
-}
 
-std::vector<Environment*> environments()
-{
-    return envirs;
+    // Between top-level statements only rooted values refer to the heap
+    MemoryPool::safepoint();
 }
 
 } // namespace Evaluator
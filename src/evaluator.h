@@ -8,7 +8,7 @@
 
 #define THROW2(name, descr) {char buf[256];sprintf(buf, name, descr);AVal a(buf);a.markThrown(true);return a; }
 #define THROW(name) {AVal a(name);a.markThrown(true);return a;}
-#define CHECKTHROWN(v) {AVal s=(v);if(s.isThrown())return s;}
+#define CHECKTHROWN(v) {const AVal &s=(v);if(s.isThrown())return s;}
 
 
 
@@ -22,18 +22,44 @@ namespace Evaluator
         ReturnLValue = 1
     };
 
+    enum Mode {
+        BytecodeMode,
+        AstMode
+    };
+
     
     void init();
     void exit();
 
     void eval(Ast::Node *p);
 
+    void setMode(Mode mode);
+    Mode mode();
+
     void setExFlag(ExFlag flag);
     bool testExFlag(ExFlag flag);
     void clearExFlag(ExFlag flag);
     AVal ex(Ast::Node *p, Environment* envir);
 
-    AVal INVOKE_INTERNAL( const char* name, Environment* envir, std::initializer_list<AVal> list );
+    AVal &variable(Ast::Variable *v, Environment *envir);
+    AVal assignToReference(AVal *ref, const AVal &value);
+    AVal assignTo(Ast::Expression *v, const AVal &value, Environment *envir);
+    AVal subscript(const AVal &arr, int index, bool lvalue);
+    // Looks up the key in maps, other values are indexed by the int value of the key
+    AVal subscript(const AVal &arr, const AVal &index, bool lvalue);
+    // Function the call site calls, global functions are cached in the call node
+    AVal callee(Ast::FunctionCall *v, Environment *envir);
+    AVal call(const AVal &func, Ast::FunctionCall *v, Environment *envir);
+    AVal call(const AVal &func, const std::vector<AVal> &args, Environment *envir);
+    // Call made by a return in a function frame. When the frame is not needed
+    // after it, only the arguments are evaluated and the call is left to the
+    // caller of the frame.
+    AVal tailCall(const AVal &func, Ast::FunctionCall *v, Environment *envir);
+    AVal binaryOp(Ast::BinaryOperator::Op op, const AVal &a, const AVal &b);
+    // Operators of nodes which specialize themselves, see Ast::Specialization
+    AVal binaryOp(Ast::BinaryOperator::Op op, Ast::Specialization &spec, const AVal &a, const AVal &b);
+    // Reads the element, the index is dereferenced on the generic path
+    AVal subscript(Ast::Specialization &spec, const AVal &arr, const AVal &index);
 
-    std::vector<Environment*> environments();
+    AVal INVOKE_INTERNAL( const char* name, Environment* envir, std::initializer_list<AVal> list );
 }
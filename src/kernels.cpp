@@ -0,0 +1,462 @@
+#include "kernels.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define KERNELS_X86 1
+#endif
+
+namespace Kernels
+{
+
+struct Table {
+    int (*sumInt)(const int*, size_t);
+    double (*sumDouble)(const double*, size_t);
+    int (*minInt)(const int*, size_t);
+    int (*maxInt)(const int*, size_t);
+    double (*minDouble)(const double*, size_t);
+    double (*maxDouble)(const double*, size_t);
+    long (*indexOfInt)(const int*, size_t, int);
+    long (*indexOfDouble)(const double*, size_t, double);
+    bool (*equalDouble)(const double*, const double*, size_t);
+    void (*fillInt)(int*, size_t, int);
+    void (*fill64)(uint64_t*, size_t, uint64_t);
+};
+
+
+// Scalar versions, they also finish the elements left over by vector loops.
+// Ints wrap around on overflow the same way as in scripts.
+
+static int sumIntScalar(const int *a, size_t n)
+{
+    unsigned s = 0;
+    for (size_t i = 0; i < n; ++i) {
+        s += unsigned(a[i]);
+    }
+    return int(s);
+}
+
+static double sumDoubleScalar(const double *a, size_t n)
+{
+    double s = 0;
+    for (size_t i = 0; i < n; ++i) {
+        s += a[i];
+    }
+    return s;
+}
+
+// Keeps the first of equal elements, like if (x < m) m = x
+template<typename T>
+static T minScalar(const T *a, size_t n, T m)
+{
+    for (size_t i = 0; i < n; ++i) {
+        if (a[i] < m) {
+            m = a[i];
+        }
+    }
+    return m;
+}
+
+template<typename T>
+static T maxScalar(const T *a, size_t n, T m)
+{
+    for (size_t i = 0; i < n; ++i) {
+        if (a[i] > m) {
+            m = a[i];
+        }
+    }
+    return m;
+}
+
+static int minIntScalar(const int *a, size_t n) { return minScalar(a + 1, n - 1, a[0]); }
+static int maxIntScalar(const int *a, size_t n) { return maxScalar(a + 1, n - 1, a[0]); }
+static double minDoubleScalar(const double *a, size_t n) { return minScalar(a + 1, n - 1, a[0]); }
+static double maxDoubleScalar(const double *a, size_t n) { return maxScalar(a + 1, n - 1, a[0]); }
+
+template<typename T>
+static long indexOfScalar(const T *a, size_t n, T v, size_t from = 0)
+{
+    for (size_t i = from; i < n; ++i) {
+        if (a[i] == v) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static long indexOfIntScalar(const int *a, size_t n, int v) { return indexOfScalar(a, n, v); }
+static long indexOfDoubleScalar(const double *a, size_t n, double v) { return indexOfScalar(a, n, v); }
+
+static bool equalDoubleScalar(const double *a, const double *b, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        if (!(a[i] == b[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+template<typename T>
+static void fillScalar(T *a, size_t n, T v)
+{
+    for (size_t i = 0; i < n; ++i) {
+        a[i] = v;
+    }
+}
+
+static void fillIntScalar(int *a, size_t n, int v) { fillScalar(a, n, v); }
+static void fill64Scalar(uint64_t *a, size_t n, uint64_t v) { fillScalar(a, n, v); }
+
+static const Table scalarTable = {
+    sumIntScalar, sumDoubleScalar,
+    minIntScalar, maxIntScalar, minDoubleScalar, maxDoubleScalar,
+    indexOfIntScalar, indexOfDoubleScalar,
+    equalDoubleScalar,
+    fillIntScalar, fill64Scalar
+};
+
+
+#ifdef KERNELS_X86
+
+// SSE2, always present on x86-64
+
+static int sumIntSSE2(const int *a, size_t n)
+{
+    __m128i s = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        s = _mm_add_epi32(s, _mm_loadu_si128((const __m128i*)(a + i)));
+    }
+    int lanes[4];
+    _mm_storeu_si128((__m128i*)lanes, s);
+    return sumIntScalar(lanes, 4) + sumIntScalar(a + i, n - i);
+}
+
+static double sumDoubleSSE2(const double *a, size_t n)
+{
+    __m128d s = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        s = _mm_add_pd(s, _mm_loadu_pd(a + i));
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, s);
+    return lanes[0] + lanes[1] + sumDoubleScalar(a + i, n - i);
+}
+
+// SSE2 has no min/max for 32-bit ints, lanes are selected by a comparison mask
+static int minIntSSE2(const int *a, size_t n)
+{
+    if (n < 4) {
+        return minIntScalar(a, n);
+    }
+    __m128i m = _mm_loadu_si128((const __m128i*)a);
+    size_t i = 4;
+    for (; i + 4 <= n; i += 4) {
+        const __m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+        const __m128i less = _mm_cmplt_epi32(x, m);
+        m = _mm_or_si128(_mm_and_si128(less, x), _mm_andnot_si128(less, m));
+    }
+    int lanes[4];
+    _mm_storeu_si128((__m128i*)lanes, m);
+    return minScalar(a + i, n - i, minIntScalar(lanes, 4));
+}
+
+static int maxIntSSE2(const int *a, size_t n)
+{
+    if (n < 4) {
+        return maxIntScalar(a, n);
+    }
+    __m128i m = _mm_loadu_si128((const __m128i*)a);
+    size_t i = 4;
+    for (; i + 4 <= n; i += 4) {
+        const __m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+        const __m128i greater = _mm_cmpgt_epi32(x, m);
+        m = _mm_or_si128(_mm_and_si128(greater, x), _mm_andnot_si128(greater, m));
+    }
+    int lanes[4];
+    _mm_storeu_si128((__m128i*)lanes, m);
+    return maxScalar(a + i, n - i, maxIntScalar(lanes, 4));
+}
+
+// minpd(x, m) is x < m ? x : m, the same choice the scalar loop makes
+static double minDoubleSSE2(const double *a, size_t n)
+{
+    if (n < 2) {
+        return minDoubleScalar(a, n);
+    }
+    __m128d m = _mm_loadu_pd(a);
+    size_t i = 2;
+    for (; i + 2 <= n; i += 2) {
+        m = _mm_min_pd(_mm_loadu_pd(a + i), m);
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, m);
+    return minScalar(a + i, n - i, minDoubleScalar(lanes, 2));
+}
+
+static double maxDoubleSSE2(const double *a, size_t n)
+{
+    if (n < 2) {
+        return maxDoubleScalar(a, n);
+    }
+    __m128d m = _mm_loadu_pd(a);
+    size_t i = 2;
+    for (; i + 2 <= n; i += 2) {
+        m = _mm_max_pd(_mm_loadu_pd(a + i), m);
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, m);
+    return maxScalar(a + i, n - i, maxDoubleScalar(lanes, 2));
+}
+
+static long indexOfIntSSE2(const int *a, size_t n, int v)
+{
+    const __m128i needle = _mm_set1_epi32(v);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        const __m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(a + i)), needle);
+        if (const int mask = _mm_movemask_ps(_mm_castsi128_ps(eq))) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return indexOfScalar(a, n, v, i);
+}
+
+static long indexOfDoubleSSE2(const double *a, size_t n, double v)
+{
+    const __m128d needle = _mm_set1_pd(v);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        if (const int mask = _mm_movemask_pd(_mm_cmpeq_pd(_mm_loadu_pd(a + i), needle))) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return indexOfScalar(a, n, v, i);
+}
+
+static bool equalDoubleSSE2(const double *a, const double *b, size_t n)
+{
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        if (_mm_movemask_pd(_mm_cmpeq_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i))) != 0x3) {
+            return false;
+        }
+    }
+    return equalDoubleScalar(a + i, b + i, n - i);
+}
+
+static void fillIntSSE2(int *a, size_t n, int v)
+{
+    const __m128i x = _mm_set1_epi32(v);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_si128((__m128i*)(a + i), x);
+    }
+    fillScalar(a + i, n - i, v);
+}
+
+static void fill64SSE2(uint64_t *a, size_t n, uint64_t v)
+{
+    const __m128i x = _mm_set1_epi64x(v);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        _mm_storeu_si128((__m128i*)(a + i), x);
+    }
+    fillScalar(a + i, n - i, v);
+}
+
+static const Table sse2Table = {
+    sumIntSSE2, sumDoubleSSE2,
+    minIntSSE2, maxIntSSE2, minDoubleSSE2, maxDoubleSSE2,
+    indexOfIntSSE2, indexOfDoubleSSE2,
+    equalDoubleSSE2,
+    fillIntSSE2, fill64SSE2
+};
+
+
+// AVX2, compiled for it separately and used only when the CPU reports it
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static int sumIntAVX2(const int *a, size_t n)
+{
+    __m256i s = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        s = _mm256_add_epi32(s, _mm256_loadu_si256((const __m256i*)(a + i)));
+    }
+    int lanes[8];
+    _mm256_storeu_si256((__m256i*)lanes, s);
+    return sumIntScalar(lanes, 8) + sumIntScalar(a + i, n - i);
+}
+
+AVX2 static double sumDoubleAVX2(const double *a, size_t n)
+{
+    // Two accumulators hide latency of the additions
+    __m256d s0 = _mm256_setzero_pd();
+    __m256d s1 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        s0 = _mm256_add_pd(s0, _mm256_loadu_pd(a + i));
+        s1 = _mm256_add_pd(s1, _mm256_loadu_pd(a + i + 4));
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, _mm256_add_pd(s0, s1));
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + sumDoubleScalar(a + i, n - i);
+}
+
+AVX2 static int minIntAVX2(const int *a, size_t n)
+{
+    if (n < 8) {
+        return minIntScalar(a, n);
+    }
+    __m256i m = _mm256_loadu_si256((const __m256i*)a);
+    size_t i = 8;
+    for (; i + 8 <= n; i += 8) {
+        m = _mm256_min_epi32(m, _mm256_loadu_si256((const __m256i*)(a + i)));
+    }
+    int lanes[8];
+    _mm256_storeu_si256((__m256i*)lanes, m);
+    return minScalar(a + i, n - i, minIntScalar(lanes, 8));
+}
+
+AVX2 static int maxIntAVX2(const int *a, size_t n)
+{
+    if (n < 8) {
+        return maxIntScalar(a, n);
+    }
+    __m256i m = _mm256_loadu_si256((const __m256i*)a);
+    size_t i = 8;
+    for (; i + 8 <= n; i += 8) {
+        m = _mm256_max_epi32(m, _mm256_loadu_si256((const __m256i*)(a + i)));
+    }
+    int lanes[8];
+    _mm256_storeu_si256((__m256i*)lanes, m);
+    return maxScalar(a + i, n - i, maxIntScalar(lanes, 8));
+}
+
+AVX2 static double minDoubleAVX2(const double *a, size_t n)
+{
+    if (n < 4) {
+        return minDoubleScalar(a, n);
+    }
+    __m256d m = _mm256_loadu_pd(a);
+    size_t i = 4;
+    for (; i + 4 <= n; i += 4) {
+        m = _mm256_min_pd(_mm256_loadu_pd(a + i), m);
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, m);
+    return minScalar(a + i, n - i, minDoubleScalar(lanes, 4));
+}
+
+AVX2 static double maxDoubleAVX2(const double *a, size_t n)
+{
+    if (n < 4) {
+        return maxDoubleScalar(a, n);
+    }
+    __m256d m = _mm256_loadu_pd(a);
+    size_t i = 4;
+    for (; i + 4 <= n; i += 4) {
+        m = _mm256_max_pd(_mm256_loadu_pd(a + i), m);
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, m);
+    return maxScalar(a + i, n - i, maxDoubleScalar(lanes, 4));
+}
+
+AVX2 static long indexOfIntAVX2(const int *a, size_t n, int v)
+{
+    const __m256i needle = _mm256_set1_epi32(v);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m256i eq = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*)(a + i)), needle);
+        if (const int mask = _mm256_movemask_ps(_mm256_castsi256_ps(eq))) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return indexOfScalar(a, n, v, i);
+}
+
+AVX2 static long indexOfDoubleAVX2(const double *a, size_t n, double v)
+{
+    const __m256d needle = _mm256_set1_pd(v);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        const __m256d eq = _mm256_cmp_pd(_mm256_loadu_pd(a + i), needle, _CMP_EQ_OQ);
+        if (const int mask = _mm256_movemask_pd(eq)) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return indexOfScalar(a, n, v, i);
+}
+
+AVX2 static bool equalDoubleAVX2(const double *a, const double *b, size_t n)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        const __m256d eq = _mm256_cmp_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i), _CMP_EQ_OQ);
+        if (_mm256_movemask_pd(eq) != 0xF) {
+            return false;
+        }
+    }
+    return equalDoubleScalar(a + i, b + i, n - i);
+}
+
+AVX2 static void fillIntAVX2(int *a, size_t n, int v)
+{
+    const __m256i x = _mm256_set1_epi32(v);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_si256((__m256i*)(a + i), x);
+    }
+    fillScalar(a + i, n - i, v);
+}
+
+AVX2 static void fill64AVX2(uint64_t *a, size_t n, uint64_t v)
+{
+    const __m256i x = _mm256_set1_epi64x(v);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_si256((__m256i*)(a + i), x);
+    }
+    fillScalar(a + i, n - i, v);
+}
+
+#undef AVX2
+
+static const Table avx2Table = {
+    sumIntAVX2, sumDoubleAVX2,
+    minIntAVX2, maxIntAVX2, minDoubleAVX2, maxDoubleAVX2,
+    indexOfIntAVX2, indexOfDoubleAVX2,
+    equalDoubleAVX2,
+    fillIntAVX2, fill64AVX2
+};
+
+#endif // KERNELS_X86
+
+
+static const Table &table()
+{
+#ifdef KERNELS_X86
+    static const Table &t = __builtin_cpu_supports("avx2") ? avx2Table : sse2Table;
+#else
+    static const Table &t = scalarTable;
+#endif
+    return t;
+}
+
+int sum(const int *a, size_t n) { return table().sumInt(a, n); }
+double sum(const double *a, size_t n) { return table().sumDouble(a, n); }
+int min(const int *a, size_t n) { return table().minInt(a, n); }
+int max(const int *a, size_t n) { return table().maxInt(a, n); }
+double min(const double *a, size_t n) { return table().minDouble(a, n); }
+double max(const double *a, size_t n) { return table().maxDouble(a, n); }
+long indexOf(const int *a, size_t n, int v) { return table().indexOfInt(a, n, v); }
+long indexOf(const double *a, size_t n, double v) { return table().indexOfDouble(a, n, v); }
+bool equal(const double *a, const double *b, size_t n) { return table().equalDouble(a, b, n); }
+void fill(int *a, size_t n, int v) { table().fillInt(a, n, v); }
+void fill(uint64_t *a, size_t n, uint64_t v) { table().fill64(a, n, v); }
+
+} // namespace Kernels
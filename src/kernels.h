@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Loops over unboxed array elements. They run AVX2 or SSE2 code when the CPU
+// supports it, the implementation is picked once on first use.
+namespace Kernels
+{
+
+int sum(const int *a, size_t n);
+// Partial sums are kept per vector lane, so rounding may differ from adding in order
+double sum(const double *a, size_t n);
+
+// Arrays must not be empty
+int min(const int *a, size_t n);
+int max(const int *a, size_t n);
+double min(const double *a, size_t n);
+double max(const double *a, size_t n);
+
+// Position of the first element equal to v, -1 when there is none
+long indexOf(const int *a, size_t n, int v);
+long indexOf(const double *a, size_t n, double v);
+
+// Doubles are compared as values, 0.0 equals -0.0 and NaN equals nothing
+bool equal(const double *a, const double *b, size_t n);
+
+void fill(int *a, size_t n, int v);
+void fill(uint64_t *a, size_t n, uint64_t v);
+
+} // namespace Kernels
@@ -1,5 +1,13 @@
 #include "parser.h"
 #include "evaluator.h"
+#include "memorypool.h"
+
+#include <cerrno>
+#include <climits>
+#include <cmath>
+#include <ctime>
+#include <cstring>
+#include <cstdlib>
 
 static void interpretFile(FILE *file)
 {
@@ -8,12 +16,143 @@ static void interpretFile(FILE *file)
     Evaluator::exit();
 }
 
+// Value of option in form --name=value, nullptr if arg is another option
+static const char *optionValue(const char *arg, const char *name)
+{
+    const size_t len = strlen(name);
+    if (strncmp(arg, name, len) == 0 && arg[len] == '=') {
+        return arg + len + 1;
+    }
+    return nullptr;
+}
+
+// Options given as --name=value
+static bool takesValue(const char *arg)
+{
+    static const char *names[] = {"--gc-growth", "--gc-max-pause", "--gc-min-interval", "--gc-threads"};
+    for (const char *name : names) {
+        if (strcmp(arg, name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Parses the whole value as an integer not less than min, prints an error otherwise
+static bool parseInt(const char *name, const char *value, int min, int &result)
+{
+    char *end;
+    errno = 0;
+    const long v = strtol(value, &end, 10);
+    if (end == value || *end != '\0' || errno == ERANGE || v < min || v > INT_MAX) {
+        fprintf(stderr, "Invalid value '%s' of %s, expected an integer of at least %d!\n", value, name, min);
+        return false;
+    }
+    result = v;
+    return true;
+}
+
+// Parses the whole value as a finite number not less than min, prints an error otherwise
+static bool parseDouble(const char *name, const char *value, double min, double &result)
+{
+    char *end;
+    errno = 0;
+    const double v = strtod(value, &end);
+    if (end == value || *end != '\0' || errno == ERANGE || !std::isfinite(v) || v < min) {
+        fprintf(stderr, "Invalid value '%s' of %s, expected a number of at least %g!\n", value, name, min);
+        return false;
+    }
+    result = v;
+    return true;
+}
+
+static bool readPacerEnvironment(MemoryPool::PacerOptions &options)
+{
+    const char *v;
+    if ((v = getenv("RSPHP_GC_GROWTH")) && !parseInt("RSPHP_GC_GROWTH", v, 0, options.growth)) {
+        return false;
+    }
+    if ((v = getenv("RSPHP_GC_MAX_PAUSE")) && !parseDouble("RSPHP_GC_MAX_PAUSE", v, 0, options.maxPause)) {
+        return false;
+    }
+    if ((v = getenv("RSPHP_GC_MIN_INTERVAL")) && !parseDouble("RSPHP_GC_MIN_INTERVAL", v, 0, options.minInterval)) {
+        return false;
+    }
+    return true;
+}
+
+// Flag given by an environment variable, unset means disabled
+static bool readFlagEnvironment(const char *name, bool &enabled)
+{
+    const char *v = getenv(name);
+    int value = 0;
+    if (v && !parseInt(name, v, 0, value)) {
+        return false;
+    }
+    enabled = value != 0;
+    return true;
+}
+
 int main(int argc, char *argv[])
 {
     srand (time(NULL));
 
-    if (argc > 1) {
+    MemoryPool::PacerOptions pacer = MemoryPool::pacerOptions();
+    bool hugePages;
+    bool compaction;
+    int threads = 0;
+    const char *env = getenv("RSPHP_GC_THREADS");
+    if (!readPacerEnvironment(pacer)
+        || !readFlagEnvironment("RSPHP_GC_HUGE_PAGES", hugePages)
+        || !readFlagEnvironment("RSPHP_GC_COMPACT", compaction)
+        || (env && !parseInt("RSPHP_GC_THREADS", env, 0, threads))) {
+        return 1;
+    }
+
+    int files = 0;
+    bool stats = false;
+    for (int i = 1; i < argc; ++i) {
+        const char *v;
+        bool valid = true;
+        if (strcmp(argv[i], "--ast") == 0) {
+            Evaluator::setMode(Evaluator::AstMode);
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            stats = true;
+        } else if ((v = optionValue(argv[i], "--gc-growth"))) {
+            valid = parseInt("--gc-growth", v, 0, pacer.growth);
+        } else if ((v = optionValue(argv[i], "--gc-max-pause"))) {
+            valid = parseDouble("--gc-max-pause", v, 0, pacer.maxPause);
+        } else if ((v = optionValue(argv[i], "--gc-min-interval"))) {
+            valid = parseDouble("--gc-min-interval", v, 0, pacer.minInterval);
+        } else if (strcmp(argv[i], "--gc-huge-pages") == 0) {
+            hugePages = true;
+        } else if (strcmp(argv[i], "--gc-compact") == 0) {
+            compaction = true;
+        } else if ((v = optionValue(argv[i], "--gc-threads"))) {
+            valid = parseInt("--gc-threads", v, 0, threads);
+        } else if (strncmp(argv[i], "--", 2) != 0) {
+            files++;
+        } else if (takesValue(argv[i])) {
+            fprintf(stderr, "Missing value of %s, expected %s=value!\n", argv[i], argv[i]);
+            valid = false;
+        } else {
+            fprintf(stderr, "Unknown option %s!\n", argv[i]);
+            valid = false;
+        }
+        if (!valid) {
+            return 1;
+        }
+    }
+    MemoryPool::setPacerOptions(pacer);
+    MemoryPool::setHugePages(hugePages);
+    MemoryPool::setCompaction(compaction);
+    MemoryPool::setThreads(threads);
+
+    if (files > 0) {
         for (int i = 1; i < argc; ++i) {
+            if (strncmp(argv[i], "--", 2) == 0) {
+                continue;
+            }
             FILE *f = fopen(argv[i], "r");
             if (!f) {
                 fprintf(stderr, "Cannot read file %s!\n", argv[i]);
@@ -26,5 +165,9 @@ int main(int argc, char *argv[])
         interpretFile(stdin);
     }
 
+    if (stats) {
+        fprintf(stderr, "AVal copies: %zu (tracked %zu)\n", AVal::copies, AVal::trackedCopies);
+    }
+
     return 0;
 }
@@ -7,40 +7,410 @@
 #include <cstring>
 #include <iostream>
 #include <algorithm>
-#include <list>
-#include <queue>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <chrono>
+#include <cstddef>
+#include <new>
+
+#include <sys/mman.h>
 
 namespace MemoryPool
 {
 
 
-#define MASKUNSET(t, mask) ((t)&=(~0 ^ mask))
-#define MASKSET(t, mask) ((t)|=(mask))
 #define HASMASK(t, mask) ((t)&(mask))
 
+//Flags are read by the marker thread, the mutator is their only writer
+static inline char flagsOf(const void *mem){
+    return __atomic_load_n(&((const MemChunk::Data*)mem)->flags, __ATOMIC_RELAXED);
+}
+
+static inline void setFlags(MemChunk::Data& d, char flags){
+    __atomic_store_n(&d.flags, flags, __ATOMIC_RELAXED);
+}
 
-std::list<MemChunk> allocd;
-std::queue<const AVal*> GCqueue;
+
+std::vector<MemChunk*> allocd;
+//chunks with at least one free slot
+std::vector<MemChunk*> freeChunks;
+size_t freeSlots = 0;
+
+//Young generation: objects which did not survive two minor collections yet.
+//Objects are not moved, promotion to old generation only sets the OLD flag.
+struct YoungObject{
+    MemChunk* chunk;
+    int pos;
+};
+//minor collection runs after this many objects or bytes were allocated
+static const size_t NURSERY_SIZE = 4 * MEMCHUNK_SIZE;
+static const size_t NURSERY_BYTES = 512 * 1024;
+std::vector<YoungObject> nursery;
+size_t nurseryAllocs = 0;
+size_t nurseryBytes = 0;
+//young objects stored into old arrays, promoted by the next minor collection
+std::vector<PackedAVal> rememberedSet;
+//arrays which are marked but their elements are not traced yet
+std::vector<AArray*> markStack;
 enum GCstateType {OK = 0, DIRTY, INITMARK, BFSMARK, INITSWEEP, SWEEPSTEP, DONE};
 GCstateType GCstate = OK;
-static const int GC_MAX_STEP = 0.005;  //in s
-static const int GC_MIN_WAIT = 0.03;  //in s
+
+//Pacer: a major collection starts once the heap grows by options.growth percent
+//of the size which was live after the previous one
+PacerOptions options;
+//heap is never collected below this size
+static const size_t GC_MIN_TRIGGER = 4 * 1024 * 1024;
+size_t heapBytes = 0;
+size_t gcTrigger = GC_MIN_TRIGGER;
 
 MemChunk::MemChunk():
-    freeCnt(MEMCHUNK_SIZE)
+    freeCnt(MEMCHUNK_SIZE),
+    swept(true),
+    listed(false)
 {
+    for(int w = 0; w < FREE_MASK_WORDS; w++){
+        const int bits = MEMCHUNK_SIZE - w * 64;
+        freeMask[w] = bits >= 64 ? ~0ULL : (1ULL << bits) - 1;
+    }
+    memset(markBits, 0, sizeof(markBits));
+    for(int i = 0; i < MEMCHUNK_SIZE; i++){
+        d[i].index = i;
+    }
 };
 
 
+//Element buffers are preceded by the number of arrays sharing them,
+//copies of an array share its buffer until one of them is written to
+static inline size_t& refsOf(void *buffer){
+    return ((size_t*)buffer)[-1];
+}
+
+static void *resizeBuffer(void *buffer, size_t bytes){
+    size_t *b = (size_t*)realloc(buffer ? &refsOf(buffer) : nullptr, sizeof(size_t) + bytes);
+    if(buffer == nullptr){
+        *b = 1;
+    }
+    return b + 1;
+}
+
+static inline void freeBuffer(void *buffer){
+    free(&refsOf(buffer));
+}
+
+//drops a reference to the buffer, returns true when no array uses it anymore
+static inline bool unshareBuffer(void *buffer){
+    return buffer && __atomic_sub_fetch(&refsOf(buffer), 1, __ATOMIC_ACQ_REL) == 0;
+}
+
+static inline size_t bufferBytes(const AArray *arr, size_t capacity){
+    return capacity * AArray::elementSize(arr->kind);
+}
+
+//drops the element buffer of a released array, returns its size when it was freed
+static inline size_t releaseBuffer(const MemChunk::Data& d){
+    if(!HASMASK(d.flags, MemChunk::ARRAY)){
+        return 0;
+    }
+    AArray *arr = (AArray*)d.d;
+    if(arr->keys){
+        AKeys::release(arr->keys);
+    }
+    if(!unshareBuffer(arr->array)){
+        return 0;
+    }
+    freeBuffer(arr->array);
+    return bufferBytes(arr, arr->allocd);
+}
+
 MemChunk::Data::Data()
 {
     d = nullptr;
+    size = 0;
     flags = 0;
+    sizeClass = LARGE_OBJECT;
 };
 
 MemChunk::Data::~Data()
 {
-    free(d);
+    if(d){
+        releaseBuffer(*this);
+    }
+    //cells of slabs are released with their heap pages
+    if(sizeClass == LARGE_OBJECT){
+        free(d);
+    }
+}
+
+
+
+//Slabs and MemChunks live in pages of SLAB_SIZE carved from large mmap'd regions.
+//Pages which become empty are given back to the OS with madvise and reused first,
+//regions with no page in use are unmapped.
+static const size_t SLAB_SIZE = 64 * 1024;
+static const size_t REGION_SIZE = 64 * 1024 * 1024;
+//regions of larger heaps are backed by transparent huge pages when enabled
+static const size_t HUGE_PAGES_MIN_HEAP = 32 * 1024 * 1024;
+static_assert(sizeof(MemChunk) <= SLAB_SIZE, "MemChunk must fit into a heap page");
+
+struct Region{
+    char *base;
+    //pages carved so far and pages of them currently released
+    size_t carved;
+    size_t released;
+};
+
+static std::vector<Region> regions;
+static std::vector<char*> releasedPages;
+static bool hugePages = false;
+
+static Region *regionOf(char *page){
+    for(Region& r: regions){
+        if(page >= r.base && page < r.base + REGION_SIZE){
+            return &r;
+        }
+    }
+    X_UNREACHABLE();
+    return nullptr;
+}
+
+static void *allocHeapPage(){
+    if(!releasedPages.empty()){
+        char *page = releasedPages.back();
+        releasedPages.pop_back();
+        regionOf(page)->released--;
+        return page;
+    }
+
+    if(regions.empty() || regions.back().carved == REGION_SIZE / SLAB_SIZE){
+        //reserve one page more, so the region can be aligned to the page size
+        const size_t reserved = REGION_SIZE + SLAB_SIZE;
+        char *m = (char*)mmap(nullptr, reserved, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if(m == MAP_FAILED){
+            throw std::bad_alloc();
+        }
+        char *base = (char*)(((uintptr_t)m + SLAB_SIZE - 1) & ~(uintptr_t)(SLAB_SIZE - 1));
+        if(base > m){
+            munmap(m, base - m);
+        }
+        munmap(base + REGION_SIZE, m + reserved - (base + REGION_SIZE));
+#ifdef MADV_HUGEPAGE
+        if(hugePages && heapBytes >= HUGE_PAGES_MIN_HEAP){
+            madvise(base, REGION_SIZE, MADV_HUGEPAGE);
+        }
+#endif
+        regions.push_back({base, 0, 0});
+    }
+
+    Region& r = regions.back();
+    return r.base + SLAB_SIZE * r.carved++;
+}
+
+static void releaseHeapPage(void *p){
+    char *page = (char*)p;
+    madvise(page, SLAB_SIZE, MADV_DONTNEED);
+    releasedPages.push_back(page);
+    regionOf(page)->released++;
+}
+
+//Unmaps regions with no page in use, except the last one which pages are carved from
+static void releaseRegions(){
+    bool unmapped = false;
+    for(size_t i = 0; i + 1 < regions.size(); i++){
+        if(regions[i].released == regions[i].carved){
+            munmap(regions[i].base, REGION_SIZE);
+            regions[i].base = nullptr;
+            unmapped = true;
+        }
+    }
+    if(!unmapped){
+        return;
+    }
+    releasedPages.erase(std::remove_if(releasedPages.begin(), releasedPages.end(), [](char *page){
+        for(const Region& r: regions){
+            if(r.base && page >= r.base && page < r.base + REGION_SIZE){
+                return false;
+            }
+        }
+        return true;
+    }), releasedPages.end());
+    regions.erase(std::remove_if(regions.begin(), regions.end(), [](const Region& r){
+        return r.base == nullptr;
+    }), regions.end());
+}
+
+void setHugePages(bool enabled)
+{
+    hugePages = enabled;
+}
+
+
+
+//Small objects are allocated from slabs segregated by size class,
+//free cells of each class are linked into its free list
+static const size_t SIZE_CLASSES[] = {16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048};
+static const int SIZE_CLASS_COUNT = sizeof(SIZE_CLASSES) / sizeof(SIZE_CLASSES[0]);
+static const size_t MAX_SMALL_SIZE = 2048;
+
+struct SizeClass{
+    char *bump = nullptr;
+    char *end = nullptr;
+    void *freeList = nullptr;
+};
+
+//Header at the start of each slab, cells follow it
+struct alignas(16) Slab{
+    //cells in use, updated atomically by sweeping workers
+    unsigned live;
+    unsigned char sizeClass;
+    bool releasing;
+};
+
+static SizeClass sizeClasses[SIZE_CLASS_COUNT];
+static std::vector<Slab*> slabList;
+//slabs which may have no cell in use, they are released after a sweep
+//or after a minor collection which emptied at least MIN_RELEASED_SLABS of them
+static unsigned emptySlabs = 0;
+static const unsigned MIN_RELEASED_SLABS = 16;
+
+static inline Slab *slabOf(void *cell){
+    return (Slab*)((uintptr_t)cell & ~(uintptr_t)(SLAB_SIZE - 1));
+}
+
+static inline void slabCellFreed(void *cell){
+    if(__atomic_sub_fetch(&slabOf(cell)->live, 1, __ATOMIC_RELAXED) == 0){
+        __atomic_add_fetch(&emptySlabs, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static inline int sizeClassOf(size_t size){
+    //index by size in 16 byte steps
+    static unsigned char table[MAX_SMALL_SIZE / 16 + 1];
+    static bool initialized = false;
+    if(!initialized){
+        int c = 0;
+        for(size_t i = 0; i <= MAX_SMALL_SIZE / 16; i++){
+            while(SIZE_CLASSES[c] < i * 16){
+                c++;
+            }
+            table[i] = c;
+        }
+        initialized = true;
+    }
+
+    if(size > MAX_SMALL_SIZE){
+        return MemChunk::LARGE_OBJECT;
+    }
+    return table[(size + 15) / 16];
+}
+
+static inline void *allocCell(int c){
+    SizeClass& sc = sizeClasses[c];
+    void *cell = sc.freeList;
+    if(cell){
+        sc.freeList = *(void**)cell;
+        slabOf(cell)->live++;
+        return cell;
+    }
+
+    if(sc.bump == nullptr || sc.bump + SIZE_CLASSES[c] > sc.end){
+        Slab *slab = new (allocHeapPage()) Slab();
+        slab->sizeClass = c;
+        slabList.push_back(slab);
+        sc.bump = (char*)(slab + 1);
+        sc.end = (char*)slab + SLAB_SIZE;
+    }
+    cell = sc.bump;
+    sc.bump += SIZE_CLASSES[c];
+    slabOf(cell)->live++;
+    return cell;
+}
+
+static inline void freeCell(void *cell, int c){
+    if(c == MemChunk::LARGE_OBJECT){
+        free(cell);
+        return;
+    }
+    SizeClass& sc = sizeClasses[c];
+    *(void**)cell = sc.freeList;
+    sc.freeList = cell;
+    slabCellFreed(cell);
+}
+
+static inline Slab *bumpSlab(int c){
+    return sizeClasses[c].end ? slabOf(sizeClasses[c].end - 1) : nullptr;
+}
+
+//Unlinks free cells of slabs flagged releasing or chosen by select from the free lists,
+//newly chosen slabs are flagged and added to selected. The slab cells are bumped from is kept.
+template<typename F>
+static void unlinkSlabs(F select, std::vector<Slab*>& selected){
+    for(int c = 0; c < SIZE_CLASS_COUNT; c++){
+        Slab *current = bumpSlab(c);
+        void **link = &sizeClasses[c].freeList;
+        while(*link){
+            Slab *slab = slabOf(*link);
+            if(slab == current || !(slab->releasing || select(slab))){
+                link = (void**)*link;
+                continue;
+            }
+            *link = *(void**)*link;
+            if(!slab->releasing){
+                slab->releasing = true;
+                selected.push_back(slab);
+            }
+        }
+    }
+}
+
+static void releaseSlabs(const std::vector<Slab*>& released){
+    if(released.empty()){
+        return;
+    }
+    slabList.erase(std::remove_if(slabList.begin(), slabList.end(), [](Slab *slab){
+        return slab->releasing;
+    }), slabList.end());
+    for(Slab *slab: released){
+        releaseHeapPage(slab);
+    }
+}
+
+//Returns slabs with no cell in use and empty chunks to the OS
+static void releaseEmptyMemory(){
+    if(emptySlabs){
+        std::vector<Slab*> released;
+        unlinkSlabs([](Slab *slab){ return slab->live == 0; }, released);
+        releaseSlabs(released);
+        emptySlabs = 0;
+    }
+
+    //one empty chunk is kept for next allocations
+    MemChunk *spare = nullptr;
+    auto isReleased = [&](MemChunk *m){
+        return m->freeCnt == MEMCHUNK_SIZE && m != spare;
+    };
+    for(MemChunk *m: allocd){
+        if(m->freeCnt == MEMCHUNK_SIZE){
+            spare = m;
+            break;
+        }
+    }
+    nursery.erase(std::remove_if(nursery.begin(), nursery.end(), [&](const YoungObject& y){
+        return isReleased(y.chunk);
+    }), nursery.end());
+    freeChunks.erase(std::remove_if(freeChunks.begin(), freeChunks.end(), isReleased), freeChunks.end());
+    auto end = std::stable_partition(allocd.begin(), allocd.end(), [&](MemChunk *m){
+        return !isReleased(m);
+    });
+    for(auto it = end; it != allocd.end(); ++it){
+        freeSlots -= MEMCHUNK_SIZE;
+        (*it)->~MemChunk();
+        releaseHeapPage(*it);
+    }
+    allocd.erase(end, allocd.end());
+
+    releaseRegions();
 }
 
 
@@ -64,83 +434,62 @@ void markDirty(){
 }
 
 
+static inline MemChunk* chunkOf(MemChunk::Data *s){
+    return (MemChunk*)((char*)(s - s->index) - offsetof(MemChunk, d));
+}
+
+static inline bool isMarked(MemChunk::Data *s){
+    const MemChunk* m = chunkOf(s);
+    return __atomic_load_n(&m->markBits[s->index / 64], __ATOMIC_RELAXED) & (1ULL << (s->index % 64));
+}
+
+//Sets the mark bit, returns false when it was already set.
+//The marker thread and the mutator may set bits of the same word.
+static inline bool setMarked(MemChunk::Data *s){
+    if(isMarked(s)){
+        return false;
+    }
+    MemChunk* m = chunkOf(s);
+    const uint64_t bit = 1ULL << (s->index % 64);
+    return !(__atomic_fetch_or(&m->markBits[s->index / 64], bit, __ATOMIC_RELAXED) & bit);
+}
+
+static inline void clearMarked(MemChunk::Data *s){
+    chunkOf(s)->markBits[s->index / 64] &= ~(1ULL << (s->index % 64));
+}
+
 static inline int findChunkFreePos(MemChunk* freechunk){
-  
-    //try 10 times random position
-    #pragma unroll
-    for(int i = 0; i < 10; i++){
-        int pos = ((unsigned int)std::rand())%MEMCHUNK_SIZE;
-        if(pos < 0){
-            pos = 0;
-        }
-        if(freechunk->d[pos].d == nullptr){
-            return pos;
+    for(int w = 0; w < MemChunk::FREE_MASK_WORDS; w++){
+        if(freechunk->freeMask[w]){
+            return w * 64 + __builtin_ctzll(freechunk->freeMask[w]);
         }
     }
-    
-    //do linear lookup
-    const int startpos = ((unsigned int)std::rand())%MEMCHUNK_SIZE;
-    unsigned int i = startpos;
-    do{
-        if(freechunk->d[i].d == nullptr){
-            return i;
-        }
-        i=(i+1)%MEMCHUNK_SIZE;
-    }while(i != startpos);
-    
+
     X_UNREACHABLE();
+    return -1;
 }
 
 static inline MemChunk* findFreeChunk(){
-    //find free chunk
-    MemChunk* freechunk = nullptr;
-        
-    //linear lokup in chunks
-    auto it = allocd.begin();
-    int chunks = 1;
-    for(; it != allocd.end(); ++it){
-        MemChunk* m = &(*it);
-        chunks++;
-        if(m->freeCnt<=0)
-          continue;
-        freechunk = m;
-        break;
-    }
-
-
-    //no free chunk found
-    if(freechunk==nullptr){
-      markDirty();
-      //mark memory as dirty and allocate new chunk
-      allocd.push_back(MemChunk());
-      freechunk = &(*allocd.rbegin());
-    }else{
-      auto nextit = it;
-      ++nextit;
-      
-      //HEURISTIC for marking memory as dirty
-      //mark memory as dirty, when there is less than 10 empty values in the last memory chunk
-      if(nextit == allocd.end()){
-        if(chunks < 5){
-          if((*it).freeCnt <= 10){
-            markDirty();
-          }
-        }else{
-          if((*it).freeCnt <= MEMCHUNK_SIZE/2){
-            markDirty();
-          }
-        }
-      }
-
+    //no free chunk, allocate new chunk
+    if(freeChunks.empty()){
+      MemChunk* freechunk = new (allocHeapPage()) MemChunk();
+      allocd.push_back(freechunk);
+      //chunk created during collection is swept at the end of the cycle
+      freechunk->swept = GCstate <= INITMARK || GCstate >= DONE;
+      freechunk->listed = true;
+      freeChunks.push_back(freechunk);
+      freeSlots += MEMCHUNK_SIZE;
+      return freechunk;
     }
-    
-    
-    return freechunk;
+
+    return freeChunks.back();
 }
 
 
 void *alloc(size_t size, void **memchunk)
 {
+    //check if there is need to collect garbage, the new memory is not referenced by any root yet
+    collectGarbage();
 
     //find free Memory chunk
     MemChunk* freechunk = findFreeChunk();
@@ -150,92 +499,521 @@ void *alloc(size_t size, void **memchunk)
 
 
     freechunk->freeCnt--;
+    freeSlots--;
+    freechunk->freeMask[freepos / 64] &= ~(1ULL << (freepos % 64));
+    if(freechunk->freeCnt == 0){
+        freechunk->listed = false;
+        freeChunks.pop_back();
+    }
 
-    void *d = calloc(1, size);
+    const int c = sizeClassOf(size);
+    void *d;
+    if(c == MemChunk::LARGE_OBJECT){
+        d = calloc(1, size);
+    }else{
+        d = allocCell(c);
+        memset(d, 0, size);
+    }
     *memchunk = &freechunk->d[freepos];
     freechunk->d[freepos].d = d;
-    freechunk->d[freepos].flags = MemChunk::FREE;
+    freechunk->d[freepos].size = size;
+    setFlags(freechunk->d[freepos], MemChunk::NURSERY);
+    freechunk->d[freepos].sizeClass = c;
+    nursery.push_back({freechunk, freepos});
+    nurseryAllocs++;
+    nurseryBytes += size;
 
-    //actually doing GC >> must set new memory as marked
-    if(GCstate != OK){
-        MASKSET(freechunk->d[freepos].flags, MemChunk::MARKED);
+    heapBytes += size;
+    if(heapBytes >= gcTrigger){
+        markDirty();
+    }
+
+    //actually doing GC >> new memory in not yet swept chunks must be marked,
+    //marking before INITMARK would stop traversal of its elements
+    if(GCstate > INITMARK && GCstate < DONE && !freechunk->swept){
+        setMarked(&freechunk->d[freepos]);
     }
-    
 
-    //check if there is need to collect garbage
-    collectGarbage();
-    
     return d;
 }
 
-static inline double CPUTime(){
-    return clock() / (double) CLOCKS_PER_SEC;
+static inline void release(MemChunk& m, int i){
+    heapBytes -= m.d[i].size + releaseBuffer(m.d[i]);
+    setFlags(m.d[i], MemChunk::FREE);
+    freeCell(m.d[i].d, m.d[i].sizeClass);
+    m.d[i].d = nullptr;
+
+    m.freeCnt++;
+    freeSlots++;
+    m.freeMask[i / 64] |= 1ULL << (i % 64);
+
+    if(!m.listed){
+        m.listed = true;
+        freeChunks.push_back(&m);
+    }
 }
 
-void cleanup()
+//monotonic time in s
+static inline double now(){
+    using namespace std::chrono;
+    return duration_cast<duration<double>>(steady_clock::now().time_since_epoch()).count();
+}
+
+void setPacerOptions(const PacerOptions& o)
 {
-    allocd.clear();
+    options = o;
+}
+
+PacerOptions pacerOptions()
+{
+    return options;
 }
 
 static inline int poolSize(){
     int s = 0;
-    for(MemChunk& m: allocd){
-        s+= MEMCHUNK_SIZE - m.freeCnt;
+    for(MemChunk* m: allocd){
+        s+= MEMCHUNK_SIZE - m->freeCnt;
     }
     return s;
 }
 
 
-static inline MemChunk::Data* getUnvisitedMemChunk(const AVal& val){
-    if(!&val)
-        return nullptr;
+static inline MemChunk::Data* dataOf(AString *str, AArray *arr){
+    if(arr)
+        return (MemChunk::Data*) arr->mem;
+    if(str)
+        return (MemChunk::Data*) str->mem;
+    return nullptr;
+}
 
-    if(!val.isArray() && !val.isString())
-        return nullptr;
-    
+static inline bool isYoung(const PackedAVal& e){
     void *m = nullptr;
-    if (val.isArray()) {
-        m = val.arrayValue->mem;
-    } else if (val.isString()) {
-        m = val.stringValue->mem;
+    if(AArray *arr = e.arrayValue()){
+        m = arr->mem;
+    }else if(AString *str = e.stringValue()){
+        m = str->mem;
     }
+    return m && !HASMASK(flagsOf(m), MemChunk::OLD);
+}
 
-    MemChunk::Data* s = (MemChunk::Data*) m;
-    if(s == nullptr)
-        return nullptr;
+//Marks the object, arrays are pushed on the mark stack to have their elements traced
+static inline void Shade(AString *str, AArray *arr){
+    MemChunk::Data* s = dataOf(str, arr);
+    if(s == nullptr || !setMarked(s))
+      return;
 
-    if(HASMASK(s->flags, MemChunk::MARKED))
-        return nullptr;
+    if(arr){
+        markStack.push_back(arr);
+    }else if(AString *base = __atomic_load_n(&str->base, __ATOMIC_ACQUIRE)){
+        Shade(base, nullptr);
+    }
+}
 
-    return s;
+//Objects a root keeps alive, element and char references keep their owner
+static inline AArray* rootArray(const AVal& v){
+    if(v._type == AVal::ARRAY){
+        return v.arrayValue;
+    }
+    return v._type == AVal::REFERENCE && v._refKind == AVal::ELEMENT_REF ? v.elementReferenceValue : nullptr;
+}
+
+static inline AString* rootString(const AVal& v){
+    if(v._type == AVal::STRING){
+        return v.stringValue;
+    }
+    return v._type == AVal::REFERENCE && v._refKind == AVal::CHAR_REF ? v.charReferenceValue : nullptr;
+}
+
+static inline void Shade(const AVal& val){
+    if(AArray *arr = rootArray(val)){
+        Shade(nullptr, arr);
+    }else if(AString *str = rootString(val)){
+        Shade(str, nullptr);
+    }
+}
+
+static inline void Trace(AArray *arr, std::vector<PackedAVal>& remembered){
+    //full marking visits every old array, so it rebuilds the remembered set
+    const bool old = HASMASK(flagsOf(arr->mem), MemChunk::OLD);
+    //the mutator publishes elements before count and a grown buffer before new elements
+    const size_t count = __atomic_load_n(&arr->count, __ATOMIC_ACQUIRE);
+    if(__atomic_load_n(&arr->kind, __ATOMIC_ACQUIRE) != AArray::GENERIC){
+        return;
+    }
+    const PackedAVal *array = __atomic_load_n(&arr->array, __ATOMIC_ACQUIRE);
+    for(size_t i = 0; i < count; i++){
+        const PackedAVal e = array[i].load();
+        if(old && isYoung(e)){
+            remembered.push_back(e);
+        }
+        Shade(e.stringValue(), e.arrayValue());
+    }
+}
+
+//Traces arrays from the mark stack, at most steps of them when steps is not 0.
+//Returns true when the stack was drained.
+static bool Drain(std::vector<PackedAVal>& remembered, size_t steps = 0){
+    for(size_t i = 0; !markStack.empty(); i++){
+        if(steps && i == steps){
+            return false;
+        }
+        AArray *arr = markStack.back();
+        markStack.pop_back();
+        if(!markStack.empty()){
+            __builtin_prefetch(markStack.back());
+        }
+        Trace(arr, remembered);
+    }
+    return true;
 }
 
-inline static void Mark(const AVal& val, bool dfs = true){
-    MemChunk::Data* s = getUnvisitedMemChunk(val);
-    if(s == nullptr)
+//Marks young objects only, old objects are live in minor collection
+//and young objects they reference are in the remembered set.
+//Objects surviving second time are promoted with all young objects they reference.
+struct YoungMark{
+    AArray *arr;
+    bool promote;
+};
+std::vector<YoungMark> youngStack;
+
+static inline void MarkYoung(AString *str, AArray *arr, bool promote){
+    MemChunk::Data* s = dataOf(str, arr);
+    if(s == nullptr || HASMASK(s->flags, MemChunk::OLD))
       return;
-    
-    MASKSET(s->flags, MemChunk::MARKED);
 
-  
-    if(val.dereference().isArray()){
-      //deep recursion to mark each elements of array
-        for(int i = 0; i < val.toArray()->allocd; i++){
-            if(dfs){
-                Mark(val.toArray()->array[i].dereference(), true);
-            }else{
-                AVal v = val.toArray()->array[i].dereference();
+    promote = promote || HASMASK(s->flags, MemChunk::SURVIVED);
+    if(isMarked(s) && (!promote || HASMASK(s->flags, MemChunk::PROMOTED)))
+      return;
 
-                MemChunk::Data* toq = getUnvisitedMemChunk(v);
-                if(toq && !HASMASK(toq->flags, MemChunk::MARKED)){
-                    MASKSET(toq->flags, MemChunk::MARKED);
-                    GCqueue.push(&val);
-                }
-            }
+    setMarked(s);
+    if(promote){
+        setFlags(*s, s->flags | MemChunk::PROMOTED);
+    }
+
+    if(arr && arr->kind == AArray::GENERIC){
+        youngStack.push_back({arr, promote});
+    }else if(str && str->base){
+        //bases of old strings are allocated old, so promotion keeps them reachable
+        MarkYoung(str->base, nullptr, promote);
+    }
+}
+
+static void DrainYoung(){
+    while(!youngStack.empty()){
+        const YoungMark y = youngStack.back();
+        youngStack.pop_back();
+        for(size_t i = 0; i < y.arr->count; i++){
+            MarkYoung(y.arr->array[i].stringValue(), y.arr->array[i].arrayValue(), y.promote);
+        }
+    }
+}
+
+//Values held outside of the heap: the root stack and slots of running functions.
+//Marking may push temporaries on top of the root stack, so it is iterated by index.
+template<typename F>
+static void forEachRoot(F f){
+    for(size_t i = 0; i < localAVals.size(); i++){
+        f(*localAVals[i]);
+    }
+    FrameStack::forEach(f);
+}
+
+static void minorCollect(){
+    for(const PackedAVal& v: rememberedSet){
+        MarkYoung(v.stringValue(), v.arrayValue(), true);
+    }
+    forEachRoot([](const AVal& v){
+        MarkYoung(rootString(v), rootArray(v), false);
+    });
+    DrainYoung();
+
+    //nursery may contain slots released by full collection and reused,
+    //the NURSERY flag makes sure each object is processed once
+    std::vector<YoungObject> survivors;
+    for(const YoungObject& y: nursery){
+        MemChunk::Data& d = y.chunk->d[y.pos];
+        if(d.d == nullptr || !HASMASK(d.flags, MemChunk::NURSERY)){
+            continue;
         }
+        setFlags(d, d.flags & ~MemChunk::NURSERY);
+        if(!isMarked(&d)){
+            release(*y.chunk, y.pos);
+            continue;
+        }
+        clearMarked(&d);
+        if(HASMASK(d.flags, MemChunk::PROMOTED)){
+            setFlags(d, MemChunk::OLD | (d.flags & MemChunk::ARRAY));
+        }else{
+            setFlags(d, d.flags | MemChunk::SURVIVED);
+            survivors.push_back(y);
+        }
+    }
+
+    for(const YoungObject& y: survivors){
+        MemChunk::Data& d = y.chunk->d[y.pos];
+        setFlags(d, d.flags | MemChunk::NURSERY);
+    }
+    nursery.swap(survivors);
+    rememberedSet.clear();
+    nurseryAllocs = 0;
+    nurseryBytes = 0;
+
+    if(emptySlabs >= MIN_RELEASED_SLABS){
+        releaseEmptyMemory();
     }
 }
 
+//Snapshot-at-the-beginning marking: roots are marked when the cycle starts,
+//values overwritten in arrays during marking are kept in satbBuffer
+//and marked in the final remark. Objects allocated meanwhile are marked on allocation.
+bool snapshotMarking = false;
+std::vector<PackedAVal> satbBuffer;
+
+void overwriteBarrier(const PackedAVal& old)
+{
+    if(snapshotMarking && (old.stringValue() || old.arrayValue())){
+        satbBuffer.push_back(old);
+    }
+}
+
+void writeBarrier(const PackedAVal& value, AArray *array)
+{
+    //stores into young arrays are found by tracing the array itself
+    if(array && array->mem && !HASMASK(((MemChunk::Data*)array->mem)->flags, MemChunk::OLD)){
+        return;
+    }
+    if(isYoung(value)){
+        rememberedSet.push_back(value);
+    }
+}
+
+
+//Background marker thread, it owns markStack while it is busy.
+//Marking runs on the mutator thread when there is only one CPU.
+namespace Marker
+{
+    std::thread thread;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    bool busy = false;
+    std::atomic<bool> stop(false);
+    //young values found in old arrays, merged into rememberedSet in the remark
+    std::vector<PackedAVal> remembered;
+    bool enabled = std::thread::hardware_concurrency() > 1;
+}
+
+static void markerLoop(){
+    std::unique_lock<std::mutex> l(Marker::lock);
+    while(true){
+        Marker::wake.wait(l, []{ return Marker::busy || Marker::stop; });
+        if(Marker::stop){
+            return;
+        }
+        l.unlock();
+
+        while(!Drain(Marker::remembered, 1000) && !Marker::stop){
+        }
+
+        l.lock();
+        Marker::busy = false;
+        Marker::finished.notify_all();
+    }
+}
+
+static void startMarker(){
+    std::lock_guard<std::mutex> l(Marker::lock);
+    if(!Marker::thread.joinable()){
+        Marker::stop = false;
+        Marker::thread = std::thread(markerLoop);
+    }
+    Marker::busy = true;
+    Marker::wake.notify_one();
+}
+
+static bool markerBusy(bool wait){
+    std::unique_lock<std::mutex> l(Marker::lock);
+    if(wait){
+        Marker::finished.wait(l, []{ return !Marker::busy; });
+    }
+    return Marker::busy;
+}
+
+static void stopMarker(){
+    if(!Marker::thread.joinable()){
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> l(Marker::lock);
+        Marker::stop = true;
+        Marker::wake.notify_one();
+    }
+    Marker::thread.join();
+    Marker::busy = false;
+    Marker::remembered.clear();
+}
+
+
+//element buffers replaced while the marker thread could read them, freed after the remark
+std::vector<void*> retiredBuffers;
+
+static void freeRetiredBuffers(){
+    for(void *b: retiredBuffers){
+        freeBuffer(b);
+    }
+    retiredBuffers.clear();
+}
+
+static void chargeBuffer(const MemChunk::Data& d, size_t bytes){
+    if(!HASMASK(d.flags, MemChunk::OLD)){
+        nurseryBytes += bytes;
+    }
+    heapBytes += bytes;
+    if(heapBytes >= gcTrigger){
+        markDirty();
+    }
+}
+
+AArray *allocArray(size_t capacity, AArray::Kind kind)
+{
+    void *mem;
+    AArray *a = (AArray*)alloc(sizeof(AArray), &mem);
+    MemChunk::Data *d = (MemChunk::Data*)mem;
+    a->mem = mem;
+    a->kind = kind;
+    a->allocd = capacity;
+    a->array = capacity ? (PackedAVal*)resizeBuffer(nullptr, bufferBytes(a, capacity)) : nullptr;
+    setFlags(*d, d->flags | MemChunk::ARRAY);
+    chargeBuffer(*d, bufferBytes(a, capacity));
+    return a;
+}
+
+AArray *allocMap(size_t capacity)
+{
+    AArray *a = allocArray(capacity);
+    a->keys = new AKeys;
+    return a;
+}
+
+//moves elements of the array to a new buffer of its own, converting them to the kind
+static void replaceBuffer(AArray *array, size_t capacity, AArray::Kind kind){
+    void *old = array->array;
+    const size_t oldBytes = bufferBytes(array, array->allocd);
+    void *buffer = resizeBuffer(nullptr, capacity * AArray::elementSize(kind));
+    if(kind == array->kind){
+        memcpy(buffer, old, bufferBytes(array, array->count));
+    }else{
+        //only generic storage takes values of every type
+        X_ASSERT(kind == AArray::GENERIC || array->count == 0);
+        for(size_t i = 0; i < array->count; i++){
+            ((PackedAVal*)buffer)[i] = array->get(i);
+        }
+    }
+    //marker loads the kind first, so generic kind is never seen with unboxed elements
+    __atomic_store_n(&array->array, (PackedAVal*)buffer, __ATOMIC_RELEASE);
+    __atomic_store_n(&array->kind, kind, __ATOMIC_RELEASE);
+    chargeBuffer(*(MemChunk::Data*)array->mem, bufferBytes(array, capacity));
+
+    if(unshareBuffer(old)){
+        heapBytes -= oldBytes;
+        if(snapshotMarking && Marker::enabled){
+            retiredBuffers.push_back(old);
+        }else{
+            freeBuffer(old);
+        }
+    }
+    array->allocd = capacity;
+}
+
+void growArray(AArray *array, size_t capacity)
+{
+    //a buffer the marker thread may be reading or other arrays share is not resized
+    if((array->array && refsOf(array->array) > 1) || (snapshotMarking && Marker::enabled)){
+        replaceBuffer(array, capacity, array->kind);
+        return;
+    }
+    //glibc moves large buffers with mremap instead of copying them
+    __atomic_store_n(&array->array, (PackedAVal*)resizeBuffer(array->array, bufferBytes(array, capacity)), __ATOMIC_RELEASE);
+    chargeBuffer(*(MemChunk::Data*)array->mem, bufferBytes(array, capacity - array->allocd));
+    array->allocd = capacity;
+}
+
+void convertArray(AArray *array, AArray::Kind kind)
+{
+    if(array->kind != kind){
+        replaceBuffer(array, array->allocd, kind);
+    }
+}
+
+AArray *copyArray(AArray *array)
+{
+    AArray *a = allocArray(0, array->kind);
+    if(array->array){
+        __atomic_add_fetch(&refsOf(array->array), 1, __ATOMIC_RELAXED);
+        a->array = array->array;
+        a->allocd = array->allocd;
+        a->count = array->count;
+    }
+    if(array->keys){
+        __atomic_add_fetch(&array->keys->refs, 1, __ATOMIC_RELAXED);
+        a->keys = array->keys;
+    }
+    return a;
+}
+
+void makeWritable(AArray *array)
+{
+    if(array->array && refsOf(array->array) > 1){
+        replaceBuffer(array, array->allocd, array->kind);
+    }
+    if(array->keys && array->keys->refs > 1){
+        AKeys *keys = array->keys->clone();
+        AKeys::release(array->keys);
+        array->keys = keys;
+    }
+}
+
+AString *copyString(AString *str)
+{
+    AString *base = str->base ? str->base : str;
+    void *mem;
+    AString *s = (AString*)alloc(AString::allocSize(1), &mem);
+    s->mem = mem;
+    s->base = base;
+    s->hash = str->hash;
+    base->shared = true;
+    return s;
+}
+
+char *makeWritable(AString *str)
+{
+    //characters may be changed through a reference later, so their hash is not kept
+    str->written = true;
+    str->hash = 0;
+    AString *target = str->base ? str->base : str;
+    if(!target->shared){
+        return target->string;
+    }
+
+    const size_t size = strlen(target->string) + 1;
+    void *mem;
+    AString *base = (AString*)alloc(AString::allocSize(size), &mem);
+    memcpy(base->string, target->string, size);
+    base->mem = mem;
+    //old strings must not refer to young ones, there is no remembered set for bases
+    if(HASMASK(((MemChunk::Data*)str->mem)->flags, MemChunk::OLD)){
+        setFlags(*(MemChunk::Data*)mem, MemChunk::OLD);
+    }
+
+    if(str->base){
+        PackedAVal old;
+        old.bits = PackedAVal::Boxed | (uint64_t(PackedAVal::STRING_TAG) << PackedAVal::TagShift) | reinterpret_cast<uintptr_t>(str->base);
+        overwriteBarrier(old);
+    }
+    __atomic_store_n(&str->base, base, __ATOMIC_RELEASE);
+    return base->string;
+}
+
 
 // Mark & Sweep
 double timeGCrawSpent = 0., timeGCStart = 0., lastGcEnd = 0.;
@@ -243,20 +1021,343 @@ size_t collected = 0;
 int chunks = 0;
 int size;
 bool silent;
-std::list<MemoryPool::MemChunk>::iterator curMemChunk;
+size_t curMemChunk;
+
+//Result of sweeping a range of chunks, merged into the global state by the mutator
+struct SweepResult{
+    size_t collected = 0;
+    size_t bytes = 0;
+    //chunks which got free slots and are not in freeChunks yet
+    std::vector<MemChunk*> relisted;
+    //released cells of each size class, linked through their first word
+    void *head[SIZE_CLASS_COUNT];
+    void *tail[SIZE_CLASS_COUNT];
+
+    SweepResult(){
+        clear();
+    }
+    void clear(){
+        collected = 0;
+        bytes = 0;
+        relisted.clear();
+        for(int c = 0; c < SIZE_CLASS_COUNT; c++){
+            head[c] = tail[c] = nullptr;
+        }
+    }
+};
+
+//Releases unmarked objects of the chunk, touches no state shared with other chunks
+static void sweepChunk(MemChunk& m, SweepResult& r){
+    const int freeCnt = m.freeCnt;
+    for(int w = 0; w < MemChunk::FREE_MASK_WORDS; w++){
+        //used and not marked slots, bits past the chunk end are never used
+        uint64_t dead = ~m.freeMask[w] & ~m.markBits[w];
+        if(w == MemChunk::FREE_MASK_WORDS - 1 && MEMCHUNK_SIZE % 64){
+            dead &= (1ULL << (MEMCHUNK_SIZE % 64)) - 1;
+        }
+        while(dead){
+            const int i = w * 64 + __builtin_ctzll(dead);
+            dead &= dead - 1;
+            MemChunk::Data& d = m.d[i];
+
+            const int c = d.sizeClass;
+            r.bytes += d.size + releaseBuffer(d);
+            if(c == MemChunk::LARGE_OBJECT){
+                free(d.d);
+            }else{
+                slabCellFreed(d.d);
+                *(void**)d.d = r.head[c];
+                if(r.head[c] == nullptr){
+                    r.tail[c] = d.d;
+                }
+                r.head[c] = d.d;
+            }
+            setFlags(d, MemChunk::FREE);
+            d.d = nullptr;
+            m.freeCnt++;
+            m.freeMask[w] |= 1ULL << (i % 64);
+        }
+    }
+    memset(m.markBits, 0, sizeof(m.markBits));
+
+    r.collected += m.freeCnt - freeCnt;
+    if(!m.listed && m.freeCnt > 0){
+        r.relisted.push_back(&m);
+    }
+    m.swept = true;
+}
+
+static void mergeSweep(SweepResult& r){
+    for(int c = 0; c < SIZE_CLASS_COUNT; c++){
+        if(r.head[c]){
+            *(void**)r.tail[c] = sizeClasses[c].freeList;
+            sizeClasses[c].freeList = r.head[c];
+        }
+    }
+    for(MemChunk* m: r.relisted){
+        m->listed = true;
+        freeChunks.push_back(m);
+    }
+    freeSlots += r.collected;
+    heapBytes -= r.bytes;
+    r.clear();
+}
+
+//Worker pool sweeping the heap in parallel, the mutator takes the first part.
+//Sweeping is incremental on the mutator thread when there is only one CPU.
+namespace Sweeper
+{
+    std::vector<std::thread> workers;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    size_t generation = 0;
+    int pending = 0;
+    bool stop = false;
+    std::vector<MemChunk*> chunks;
+    std::vector<SweepResult> results;
+    int parts = std::min(8u, std::thread::hardware_concurrency());
+    //smaller heaps are swept incrementally, waking the workers would cost more
+    size_t minChunks = 64;
+}
+
+static void sweepPart(int part){
+    const size_t n = Sweeper::chunks.size();
+    const size_t end = n * (part + 1) / Sweeper::parts;
+    for(size_t i = n * part / Sweeper::parts; i < end; i++){
+        sweepChunk(*Sweeper::chunks[i], Sweeper::results[part]);
+    }
+}
+
+static void sweepWorker(int part, size_t seen){
+    std::unique_lock<std::mutex> l(Sweeper::lock);
+    while(true){
+        Sweeper::wake.wait(l, [&]{ return Sweeper::stop || Sweeper::generation != seen; });
+        if(Sweeper::stop){
+            return;
+        }
+        seen = Sweeper::generation;
+        l.unlock();
+
+        sweepPart(part);
+
+        l.lock();
+        if(--Sweeper::pending == 0){
+            Sweeper::finished.notify_one();
+        }
+    }
+}
+
+static void parallelSweep(){
+    Sweeper::chunks = allocd;
+    Sweeper::results.resize(Sweeper::parts);
+
+    {
+        std::lock_guard<std::mutex> l(Sweeper::lock);
+        for(int part = Sweeper::workers.size() + 1; part < Sweeper::parts; part++){
+            Sweeper::workers.push_back(std::thread(sweepWorker, part, Sweeper::generation));
+        }
+        Sweeper::pending = Sweeper::parts - 1;
+        Sweeper::generation++;
+        Sweeper::wake.notify_all();
+    }
+
+    sweepPart(0);
+    {
+        std::unique_lock<std::mutex> l(Sweeper::lock);
+        Sweeper::finished.wait(l, []{ return Sweeper::pending == 0; });
+    }
+
+    for(SweepResult& r: Sweeper::results){
+        collected += r.collected;
+        mergeSweep(r);
+    }
+    chunks = Sweeper::chunks.size();
+    Sweeper::chunks.clear();
+}
+
+static void stopSweeper(){
+    {
+        std::lock_guard<std::mutex> l(Sweeper::lock);
+        Sweeper::stop = true;
+        Sweeper::wake.notify_all();
+    }
+    for(std::thread& t: Sweeper::workers){
+        t.join();
+    }
+    Sweeper::workers.clear();
+    Sweeper::stop = false;
+}
+
+void setThreads(int threads)
+{
+    const int n = threads > 0 ? threads : std::thread::hardware_concurrency();
+    Marker::enabled = n > 1;
+    Sweeper::parts = std::min(8, n);
+    //an explicit count sweeps every heap in parallel, so small scripts exercise the workers
+    if(threads > 0){
+        Sweeper::minChunks = 1;
+    }
+}
+
+
+
+//Compaction: live objects are evacuated from sparse slabs, which are then released.
+//Objects are moved at safepoints only, where no raw pointer to the heap is held outside
+//of rooted AVals and arrays. The old copy keeps its mem back-pointer, so it leads
+//to the new location through MemChunk::Data::d.
+static bool compaction = false;
+static bool compactionPending = false;
+//heap is compacted when more than half of slab memory is free and at least this much
+static const size_t COMPACT_MIN_FREE = 1024 * 1024;
+
+void setCompaction(bool enabled)
+{
+    compaction = enabled;
+}
+
+static inline size_t slabCapacity(int c){
+    return (SLAB_SIZE - sizeof(Slab)) / SIZE_CLASSES[c];
+}
+
+static inline bool isSparse(Slab *slab){
+    return slab->live * 4 < slabCapacity(slab->sizeClass);
+}
+
+static void checkFragmentation(){
+    size_t total = 0, free = 0;
+    for(Slab *slab: slabList){
+        if(slab == bumpSlab(slab->sizeClass)){
+            continue;
+        }
+        total += SLAB_SIZE;
+        free += (slabCapacity(slab->sizeClass) - slab->live) * SIZE_CLASSES[slab->sizeClass];
+    }
+    compactionPending = compaction && free >= COMPACT_MIN_FREE && free * 2 > total;
+}
+
+template<typename T>
+static inline T *forwarded(T *p){
+    if(p == nullptr || p->mem == nullptr){
+        return p;
+    }
+    return (T*)((MemChunk::Data*)p->mem)->d;
+}
+
+static inline void forward(PackedAVal& v){
+    void *p = nullptr;
+    if(AArray *arr = v.arrayValue()){
+        p = forwarded(arr);
+    }else if(AString *str = v.stringValue()){
+        p = forwarded(str);
+    }else{
+        return;
+    }
+    v.bits = (v.bits & ~PackedAVal::PayloadMask) | reinterpret_cast<uintptr_t>(p);
+}
+
+static void compact(){
+    //reached objects in breadth first order, it is also the order they are moved in
+    struct Reached{
+        MemChunk::Data* data;
+        bool array;
+    };
+    std::vector<Reached> reached;
+    auto reach = [&](AString *str, AArray *arr){
+        MemChunk::Data* s = dataOf(str, arr);
+        if(s && setMarked(s)){
+            reached.push_back({s, arr != nullptr});
+        }
+    };
+
+    //full collection first, so every object left is reached from roots
+    forEachRoot([&](const AVal& v){
+        reach(rootString(v), rootArray(v));
+    });
+    for(size_t i = 0; i < reached.size(); i++){
+        if(reached[i].array){
+            AArray *arr = (AArray*)reached[i].data->d;
+            for(size_t e = 0; arr->kind == AArray::GENERIC && e < arr->count; e++){
+                reach(arr->array[e].stringValue(), arr->array[e].arrayValue());
+            }
+        }else{
+            reach(((AString*)reached[i].data->d)->base, nullptr);
+        }
+    }
+    SweepResult r;
+    for(MemChunk* m: allocd){
+        sweepChunk(*m, r);
+    }
+    mergeSweep(r);
+
+    std::vector<Slab*> evacuated;
+    unlinkSlabs(isSparse, evacuated);
+
+    for(const Reached& o: reached){
+        MemChunk::Data& d = *o.data;
+        if(d.sizeClass == MemChunk::LARGE_OBJECT || !slabOf(d.d)->releasing){
+            continue;
+        }
+        void *cell = allocCell(d.sizeClass);
+        memcpy(cell, d.d, d.size);
+        slabCellFreed(d.d);
+        d.d = cell;
+    }
+
+    forEachRoot([](AVal& v){
+        //owners of element and char references share the pointer member
+        if(rootArray(v)){
+            v.arrayValue = forwarded(v.arrayValue);
+        }else if(rootString(v)){
+            v.stringValue = forwarded(v.stringValue);
+        }
+    });
+    rememberedSet.clear();
+    for(const Reached& o: reached){
+        if(!o.array){
+            AString *str = (AString*)o.data->d;
+            str->base = forwarded(str->base);
+            continue;
+        }
+        AArray *arr = (AArray*)o.data->d;
+        const bool old = HASMASK(o.data->flags, MemChunk::OLD);
+        for(size_t e = 0; arr->kind == AArray::GENERIC && e < arr->count; e++){
+            forward(arr->array[e]);
+            if(old && isYoung(arr->array[e])){
+                rememberedSet.push_back(arr->array[e]);
+            }
+        }
+    }
+
+    releaseSlabs(evacuated);
+    releaseEmptyMemory();
+}
+
+void safepoint()
+{
+    if(compactionPending && GCstate == OK){
+        compactionPending = false;
+        compact();
+    }
+}
 
 void collectGarbage( bool s, bool whole)
 {
     //just for skipping elapsed time-counters
-    if(GCstate == OK)
+    if(GCstate == OK){
+      if(nurseryAllocs >= NURSERY_SIZE || nurseryBytes >= NURSERY_BYTES){
+        minorCollect();
+      }
       return;
+    }
     
     //does not elapsed enough time to rerun GC
-    if(CPUTime() - lastGcEnd <= GC_MIN_WAIT){
+    if(GCstate == DIRTY && !whole && now() - lastGcEnd <= options.minInterval / 1000.){
       return;
     }
-  
-    double starttime = CPUTime();
+
+    const double starttime = now();
+    const double maxStep = options.maxPause / 1000.;
 
     bool doing = true;
     while(doing){
@@ -267,7 +1368,7 @@ void collectGarbage( bool s, bool whole)
                 if(!silent)
                     size = poolSize();
                 collected = 0;
-                timeGCStart = CPUTime();
+                timeGCStart = now();
                 timeGCrawSpent = 0.;
 
                 GCstate = INITMARK;
@@ -276,109 +1377,147 @@ void collectGarbage( bool s, bool whole)
             }
             case INITMARK: {
                 //we must iterate all local values on stack in the single step
-                int locals = 0;
-
-                //must create copy of the locals hash map, because there would be modified this map over there
-                auto copiedLocalAVals = localAVals;
-                for(AVal* v : copiedLocalAVals){
-                  Mark(v->dereference(), true);
-                  locals++;
+                for(MemChunk* m: allocd){
+                    m->swept = false;
                 }
+                rememberedSet.clear();
 
-                int envirs = 0;
-                int vals = 0;
-                //push all available avals into the local stack
-                for (Environment *e : Evaluator::environments()) {
-                    envirs++;
-                    for (auto it : e->keys) {
-                      GCqueue.push(&it.second);
-                      vals++;
-                    }
+                forEachRoot([](const AVal& v){
+                  Shade(v);
+                });
+
+                snapshotMarking = true;
+                if(Marker::enabled){
+                    startMarker();
                 }
 
                 GCstate = BFSMARK;
-                doing = whole || CPUTime() - starttime < GC_MAX_STEP;
+                doing = whole || now() - starttime < maxStep;
                 break;
             }
             case BFSMARK: {
-                bool do_bfs = true;          
-                int steps = 0;
+                if(Marker::enabled){
+                    if(markerBusy(whole)){
+                        break;
+                    }
+                    rememberedSet.insert(rememberedSet.end(), Marker::remembered.begin(), Marker::remembered.end());
+                    Marker::remembered.clear();
+                }
 
-                while(!GCqueue.empty() && do_bfs){
-                    Mark(GCqueue.front()->dereference(), false);
-                    GCqueue.pop();
+                bool do_bfs = true;
 
-                    //check running time, each few steps
-                    if(steps++%1000 == 0){
-                        do_bfs = CPUTime() - starttime < GC_MAX_STEP;
-                    }
+                //remark, values overwritten since the snapshot are marked with all they reference
+                for(const PackedAVal& v: satbBuffer){
+                    Shade(v.stringValue(), v.arrayValue());
+                }
+                satbBuffer.clear();
+
+                //check running time, each few steps
+                while(!Drain(rememberedSet, 1000) && do_bfs){
+                    do_bfs = now() - starttime < maxStep;
                 }
 
                 doing = whole || do_bfs;
-                if(GCqueue.empty()){
+                if(markStack.empty()){
+                    snapshotMarking = false;
+                    freeRetiredBuffers();
                     GCstate = INITSWEEP;
                 }
                 break;
             }
             case INITSWEEP: {
-                curMemChunk = allocd.begin();
+                curMemChunk = 0;
                 chunks = 0;
-                
-                doing = whole || CPUTime() - starttime < GC_MAX_STEP;
+
+                if(Sweeper::parts > 1 && allocd.size() >= Sweeper::minChunks){
+                    parallelSweep();
+                    GCstate = DONE;
+                    doing = true;
+                    break;
+                }
+
+                doing = whole || now() - starttime < maxStep;
                 GCstate = SWEEPSTEP;
                 break;
             }
             case SWEEPSTEP: {
                 bool do_sweep = true;
-                
-                while(curMemChunk != allocd.end() && do_sweep){
-                    MemChunk& m = *curMemChunk;
-
-                    for(int i = 0; i < MEMCHUNK_SIZE; i++){
-                        if(m.d[i].d == nullptr){
-                          continue;
-                        }
-
-                        if(!HASMASK(m.d[i].flags, MemChunk::MARKED)){
-                            m.d[i].flags = MemChunk::FREE;
-                            free(m.d[i].d);
-                            m.d[i].d = nullptr;
-
-                            m.freeCnt++;
-                            collected++;
-                        }else{
-                            MASKUNSET(m.d[i].flags, MemChunk::MARKED);
-                        }
-                    }
-                  
+                SweepResult r;
+
+                while(curMemChunk < allocd.size() && do_sweep){
+                    sweepChunk(*allocd[curMemChunk], r);
+                    collected += r.collected;
+                    mergeSweep(r);
                     chunks++;
                     curMemChunk++;
-                  
-                    do_sweep = CPUTime() - starttime < GC_MAX_STEP;
+
+                    do_sweep = now() - starttime < maxStep;
                 }
-                
+
                 doing = whole || do_sweep;
-                if(curMemChunk == allocd.end()){
+                if(curMemChunk == allocd.size()){
                   GCstate = DONE;
                 }
                 break;
             }
             case DONE: {
+                releaseEmptyMemory();
+                checkFragmentation();
                 if(!silent){
                     printf("------ GARBAGE COLLECTOR ------\n");
                     printf("   Objects before:     %d\n", size);
                     printf("   Objects collected:  %ld\n", collected);
                     printf("   Objects after:      %ld ( %d blocks )\n", size - collected, chunks);
-                    printf("   CPU Time elapsed:   %lf ( raw %lf )\n", CPUTime() - timeGCStart, timeGCrawSpent + (CPUTime() - starttime));
+                    printf("   Time elapsed:       %lf ( raw %lf )\n", now() - timeGCStart, timeGCrawSpent + (now() - starttime));
                     printf("-------------------------------\n");
                 }
-                lastGcEnd = CPUTime();
+                lastGcEnd = now();
+                //objects allocated during the cycle are counted as live
+                gcTrigger = std::max(GC_MIN_TRIGGER, heapBytes + heapBytes / 100 * std::max(options.growth, 0));
                 GCstate = OK;
                 break;
             }
         }
     }
-    timeGCrawSpent += CPUTime() - starttime;
+    timeGCrawSpent += now() - starttime;
+}
+
+void cleanup()
+{
+    stopMarker();
+    stopSweeper();
+    GCstate = OK;
+    markStack.clear();
+    youngStack.clear();
+    snapshotMarking = false;
+    satbBuffer.clear();
+    freeRetiredBuffers();
+
+    for(MemChunk* m: allocd){
+        m->~MemChunk();
+    }
+    allocd.clear();
+    freeChunks.clear();
+    freeSlots = 0;
+    nursery.clear();
+    rememberedSet.clear();
+    nurseryAllocs = 0;
+    nurseryBytes = 0;
+    heapBytes = 0;
+    gcTrigger = GC_MIN_TRIGGER;
+
+    for(SizeClass& sc: sizeClasses){
+        sc = SizeClass();
+    }
+    emptySlabs = 0;
+    slabList.clear();
+    compactionPending = false;
+
+    for(Region& r: regions){
+        munmap(r.base, REGION_SIZE);
+    }
+    regions.clear();
+    releasedPages.clear();
 }
 
 } // namespace MemoryPool
@@ -13,20 +13,81 @@ struct MemChunk{
 
     static const int FREE = 0;
     static const int USED = 1;
-    static const int MARKED = 1<<1;
+    //object is an AArray owning a separately allocated element buffer
+    static const int ARRAY = 1<<1;
+    static const int OLD = 1<<2;
+    static const int SURVIVED = 1<<3;
+    static const int PROMOTED = 1<<4;
+    static const int NURSERY = 1<<5;
+    static const int LARGE_OBJECT = 0xFF;
+    static const int FREE_MASK_WORDS = (MEMCHUNK_SIZE + 63) / 64;
 
     int freeCnt;
+    bool swept;
+    //chunk is in the list of chunks with free slots
+    bool listed;
+    //set bits mark free slots
+    uint64_t freeMask[FREE_MASK_WORDS];
+    //set bits mark reachable objects, cleared when the chunk is swept
+    uint64_t markBits[FREE_MASK_WORDS];
 
     struct Data{
         Data();
         ~Data();
         void *d;
+        size_t size;
         char flags;
+        unsigned char sizeClass;
+        //position in MemChunk::d
+        unsigned short index;
     } d[MEMCHUNK_SIZE];
 };
 
+struct PacerOptions{
+    //major collection starts when the heap grows by this percentage of the live size
+    int growth = 100;
+    //maximal length of one incremental collection step, in ms
+    double maxPause = 5;
+    //minimal time between the end of a collection and the start of the next one, in ms
+    double minInterval = 30;
+};
+
+void setPacerOptions(const PacerOptions& options);
+PacerOptions pacerOptions();
+//back larger heaps with transparent huge pages
+void setHugePages(bool enabled);
+//evacuate live objects from sparse slabs at safepoints after fragmenting collections
+void setCompaction(bool enabled);
+//threads the collector uses, 0 picks them by the number of CPUs. With 1 marking and
+//sweeping run on the mutator thread, with more a background thread marks concurrently
+//and up to 8 threads sweep in parallel.
+void setThreads(int threads);
+
 void *alloc(size_t size, void **memchunk);
+//allocates an empty array with room for capacity elements
+AArray *allocArray(size_t capacity, AArray::Kind kind = AArray::GENERIC);
+//allocates an empty map with room for capacity elements
+AArray *allocMap(size_t capacity = 0);
+//resizes the element buffer of the array in place, the AArray itself does not move
+void growArray(AArray *array, size_t capacity);
+//changes storage of the elements, unboxed kinds are taken by empty arrays only
+void convertArray(AArray *array, AArray::Kind kind);
+//copies sharing elements or characters with the original until one of them is written to
+AArray *copyArray(AArray *array);
+AString *copyString(AString *str);
+//must be called before elements of the array are written
+void makeWritable(AArray *array);
+//returns the characters of the string which may be written
+char *makeWritable(AString *str);
 void cleanup();
 void collectGarbage(bool silent = true, bool singlestep = false);
+//may move objects, must be called only when no raw pointer to the heap is held
+//outside of rooted AVals and arrays
+void safepoint();
+//must be called after a value is stored into element of an existing array,
+//array may be null when it is not known
+void writeBarrier(const PackedAVal& value, AArray *array = nullptr);
+//must be called before an element of an existing array is overwritten
+void overwriteBarrier(const PackedAVal& old);
 
 } // namespace MemoryPool
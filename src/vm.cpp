@@ -0,0 +1,174 @@
+#include "vm.h"
+#include "evaluator.h"
+#include "environment.h"
+#include "common.h"
+
+#include <vector>
+
+extern Environment *currentEnvironment;
+
+namespace VM
+{
+
+#define VM_CHECKTHROWN(v) if ((v).isThrown()) return (v);
+
+class LValueFlagGuard
+{
+public:
+    LValueFlagGuard()
+        : set(Evaluator::testExFlag(Evaluator::ReturnLValue))
+    {
+        Evaluator::clearExFlag(Evaluator::ReturnLValue);
+    }
+
+    ~LValueFlagGuard()
+    {
+        if (set) {
+            Evaluator::setExFlag(Evaluator::ReturnLValue);
+        }
+    }
+
+private:
+    bool set;
+};
+
+AVal run(Bytecode::Chunk *chunk, Environment *envir)
+{
+    using namespace Bytecode;
+
+    // Statements are always executed as rvalues
+    LValueFlagGuard flagGuard;
+
+    // Registers are taken from the frame stack, the collector finds them there
+    struct Registers {
+        explicit Registers(int count)
+            : count(count)
+            , values(FrameStack::push(count))
+        {
+        }
+        ~Registers()
+        {
+            FrameStack::pop(count);
+        }
+        AVal &operator[](int i)
+        {
+            return values[i];
+        }
+        const int count;
+        AVal *values;
+    } regs(chunk->registers);
+    Instruction *code = chunk->code.data();
+    int pc = 0;
+
+    currentEnvironment = envir;
+
+    while (true) {
+        Instruction &i = code[pc++];
+
+        switch (i.op) {
+        case LoadConst:
+            regs[i.a] = chunk->constants[i.b];
+            break;
+
+        case GetVar:
+            regs[i.a] = Evaluator::variable(static_cast<Ast::Variable*>(i.node), envir);
+            VM_CHECKTHROWN(regs[i.a])
+            break;
+
+        case SetVar: {
+            AVal r = Evaluator::assignToReference(&Evaluator::variable(static_cast<Ast::Variable*>(i.node), envir), regs[i.a]);
+            VM_CHECKTHROWN(r)
+            break;
+        }
+
+        case GetLocal:
+            regs[i.a] = envir->slots[i.b];
+            VM_CHECKTHROWN(regs[i.a])
+            break;
+
+        case SetLocal: {
+            AVal r = Evaluator::assignToReference(&envir->slots[i.b], regs[i.a]);
+            VM_CHECKTHROWN(r)
+            break;
+        }
+
+        case Assign: {
+            AVal r = Evaluator::assignTo(i.node, regs[i.a], envir);
+            currentEnvironment = envir;
+            VM_CHECKTHROWN(r)
+            break;
+        }
+
+        case Index:
+            regs[i.a] = Evaluator::subscript(i.spec, regs[i.b], regs[i.c]);
+            VM_CHECKTHROWN(regs[i.a])
+            break;
+
+        case GetCallee:
+            regs[i.a] = Evaluator::callee(static_cast<Ast::FunctionCall*>(i.node), envir);
+            VM_CHECKTHROWN(regs[i.a])
+            break;
+
+        case Call:
+            regs[i.a] = Evaluator::call(regs[i.b], static_cast<Ast::FunctionCall*>(i.node), envir);
+            currentEnvironment = envir;
+            VM_CHECKTHROWN(regs[i.a])
+            break;
+
+        case TailCall:
+            regs[i.a] = Evaluator::tailCall(regs[i.b], static_cast<Ast::FunctionCall*>(i.node), envir);
+            currentEnvironment = envir;
+            VM_CHECKTHROWN(regs[i.a])
+            break;
+
+        case Not:
+            regs[i.a] = !regs[i.b].toBool();
+            break;
+
+        case BinOp:
+            regs[i.a] = Evaluator::binaryOp(static_cast<Ast::BinaryOperator::Op>(i.arg), i.spec, regs[i.b], regs[i.c]);
+            VM_CHECKTHROWN(regs[i.a])
+            break;
+
+        case Jump:
+            pc = i.b;
+            break;
+
+        case JumpIfFalse:
+            if (!regs[i.a].toBool()) {
+                pc = i.b;
+            }
+            break;
+
+        case Return:
+            envir->returnValue = regs[i.a];
+            envir->state = Environment::ReturnCalled;
+            return AVal();
+
+        case Eval:
+            regs[i.a] = Evaluator::ex(i.node, envir);
+            currentEnvironment = envir;
+            VM_CHECKTHROWN(regs[i.a])
+            if (envir->state & Environment::FlowInterrupted) {
+                if (envir->state == Environment::BreakCalled && i.b >= 0) {
+                    envir->state = Environment::Normal;
+                    pc = i.b;
+                } else if (envir->state == Environment::ContinueCalled && i.c >= 0) {
+                    envir->state = Environment::Normal;
+                    pc = i.c;
+                } else {
+                    return AVal();
+                }
+            }
+            break;
+
+        case End:
+            return AVal();
+
+        default:
+            X_UNREACHABLE();
+        }
+    }
+}
+
+} // namespace VM
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "bytecode.h"
+
+class Environment;
+
+namespace VM
+{
+
+// Instructions specialize themselves while they run, so the chunk is written to
+AVal run(Bytecode::Chunk *chunk, Environment *envir);
+
+} // namespace VM